@@ -7,11 +7,17 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Kerberos includes */
@@ -30,7 +36,7 @@
 	} while (0)
 
 #ifdef HAVE_HEIMDAL
-#define K5BAIL(x)	do {						\
+#define K5BAILS(x, str)	do {						\
 		ret = x;						\
 		if (ret) {						\
 			const char	*tmp;				\
@@ -38,20 +44,38 @@
 			tmp = krb5_get_error_message(ctx, ret);		\
 			if (tmp) {					\
 				snprintf(croakstr, sizeof(croakstr),	\
-				    "%s: %s", #x, tmp);			\
+				    "%s: %s", str, tmp);		\
 				krb5_free_error_message(ctx, tmp);	\
 			} else {					\
 				snprintf(croakstr, sizeof(croakstr),	\
-				    "%s: unknown error", #x);		\
+				    "%s: unknown error", str);		\
 			}						\
 			ret = 1;					\
 			goto done;					\
 		}							\
 	} while (0)
 #else
-#define K5BAIL(x)	BAIL(x, error_message(ret))
+#define K5BAILS(x, str)	do {						\
+		ret = x;						\
+		if (ret) {						\
+			snprintf(croakstr, sizeof(croakstr),		\
+			    "%s: %s", str, error_message(ret));		\
+			ret = 1;					\
+			goto done;					\
+		}							\
+	} while (0)
 #endif
 
+#define K5BAIL(x)	K5BAILS(x, #x)
+
+/*
+ * KADM5BAIL() is K5BAIL() for calls made on the kadm5 handle ``hndl''.
+ * kadm5_pool_error() marks the handle to be rebuilt if the error says
+ * that the handle, rather than the request, is at fault.
+ */
+
+#define KADM5BAIL(x)	K5BAILS(kadm5_pool_error(hndl, x), #x)
+
 typedef	void *kadm5_handle;
 
 struct _key {
@@ -66,6 +90,39 @@ struct _key {
 
 typedef struct _key *key;
 
+struct kadm5_pool_stats {
+	int	idle;
+	int	in_use;
+	long	hits;
+	long	misses;
+	long	failed_checks;
+	long	invalidated;
+	long	destroyed;
+};
+
+typedef struct kadm5_pool_stats kadm5_pool_stats;
+
+struct _parsed_princ {
+	char			 *name;		/* as supplied */
+	char			 *canon;	/* krb5_unparse_name() */
+	int			  ncomps;	/* including the realm */
+	char			**comps;	/* the realm comes first */
+	int			 *lens;
+	struct _parsed_princ	 *hnext;	/* hash chain */
+	struct _parsed_princ	 *prev;		/* LRU list */
+	struct _parsed_princ	 *next;
+};
+
+typedef struct _parsed_princ *parsed_princ;
+typedef struct _parsed_princ *canon_princ;
+
+struct _ccache_state {
+	char		*princ;
+	krb5_timestamp	 endtime;
+};
+
+typedef struct _ccache_state *ccache_state;
+
 #include "C.h"
 
 kadm5_handle
@@ -93,10 +150,546 @@ done:
 	return hndl;
 }
 
+/*
+ * The kadm5 handle pool.  Initialising a kadm5 handle opens the database
+ * and so we keep a process-wide list of them keyed by dbname.
+ * kadm5_pool_get() lends out an idle handle if it passes a cheap health
+ * check and initialises a new one otherwise.  Handles are given back by
+ * kadm5_pool_release() which is the Perl DESTROY method for a kadm5
+ * handle, so handles that did not come from the pool are just destroyed.
+ * A handle marked with kadm5_pool_invalidate(), e.g. after an error, is
+ * destroyed when it is released rather than being lent out again.
+ *
+ * The pool's handles are initialised with a private context as they may
+ * outlive the context of the caller which first asked for them.
+ */
+
+#define KADM5_POOL_MAX_IDLE	4	/* idle handles kept per dbname */
+#define KADM5_POOL_MAX_AGE	3600	/* seconds before we rebuild */
+
+struct kadm5_pool_ent {
+	char			*dbname;
+	kadm5_handle		 hndl;
+	time_t			 created;
+	int			 in_use;
+	int			 invalid;
+	struct kadm5_pool_ent	*next;
+};
+
+static krb5_context		 kadm5_pool_ctx = NULL;
+static struct kadm5_pool_ent	*kadm5_pool = NULL;
+static kadm5_pool_stats		 kadm5_pool_counters;
+
+static int
+kadm5_pool_dbname_eq(const char *a, const char *b)
+{
+
+	if (!a || !b)
+		return a == b;
+	return !strcmp(a, b);
+}
+
+static int
+kadm5_pool_check(struct kadm5_pool_ent *ent)
+{
+#ifdef HAVE_HEIMDAL
+	uint32_t	privs;
+#else
+	long		privs;
+#endif
+
+	if (ent->invalid)
+		return 0;
+	if (time(NULL) - ent->created > KADM5_POOL_MAX_AGE)
+		return 0;
+	return kadm5_get_privs(ent->hndl, &privs) == 0;
+}
+
+static void
+kadm5_pool_free(struct kadm5_pool_ent *ent)
+{
+	struct kadm5_pool_ent	**p;
+
+	for (p = &kadm5_pool; *p; p = &(*p)->next) {
+		if (*p == ent) {
+			*p = ent->next;
+			break;
+		}
+	}
+
+	kadm5_destroy(ent->hndl);
+	free(ent->dbname);
+	free(ent);
+	kadm5_pool_counters.destroyed++;
+}
+
+kadm5_handle
+kadm5_pool_get(char *dbname)
+{
+	struct kadm5_pool_ent	*ent;
+	struct kadm5_pool_ent	*next;
+	kadm5_handle		 hndl;
+	krb5_error_code		 ret;
+
+	for (ent = kadm5_pool; ent; ent = next) {
+		next = ent->next;
+
+		if (ent->in_use || !kadm5_pool_dbname_eq(ent->dbname, dbname))
+			continue;
+
+		if (!kadm5_pool_check(ent)) {
+			kadm5_pool_counters.failed_checks++;
+			kadm5_pool_free(ent);
+			continue;
+		}
+
+		ent->in_use = 1;
+		kadm5_pool_counters.hits++;
+		return ent->hndl;
+	}
+
+	if (!kadm5_pool_ctx) {
+		ret = krb5_init_context(&kadm5_pool_ctx);
+		if (ret) {
+			kadm5_pool_ctx = NULL;
+			croak("kadm5_pool_get: krb5_init_context failed");
+		}
+	}
+
+	kadm5_pool_counters.misses++;
+
+	/* krb5_get_kadm5_hndl() croaks on failure */
+	hndl = krb5_get_kadm5_hndl(kadm5_pool_ctx, dbname);
+
+	ent = calloc(1, sizeof(*ent));
+	if (ent && dbname)
+		ent->dbname = strdup(dbname);
+	if (!ent || (dbname && !ent->dbname)) {
+		free(ent);
+		kadm5_destroy(hndl);
+		croak("kadm5_pool_get: out of memory");
+	}
+
+	ent->hndl = hndl;
+	ent->created = time(NULL);
+	ent->in_use = 1;
+	ent->next = kadm5_pool;
+	kadm5_pool = ent;
+
+	return hndl;
+}
+
+krb5_error_code
+kadm5_pool_release(kadm5_handle hndl)
+{
+	struct kadm5_pool_ent	*ent;
+	struct kadm5_pool_ent	*tmp;
+	int			 idle = 0;
+
+	for (ent = kadm5_pool; ent; ent = ent->next)
+		if (ent->hndl == hndl)
+			break;
+
+	if (!ent)
+		return kadm5_destroy(hndl);
+
+	for (tmp = kadm5_pool; tmp; tmp = tmp->next)
+		if (!tmp->in_use && kadm5_pool_dbname_eq(tmp->dbname,
+		    ent->dbname))
+			idle++;
+
+	ent->in_use = 0;
+	if (ent->invalid || idle >= KADM5_POOL_MAX_IDLE)
+		kadm5_pool_free(ent);
+
+	return 0;
+}
+
+void
+kadm5_pool_invalidate(kadm5_handle hndl)
+{
+	struct kadm5_pool_ent	*ent;
+
+	for (ent = kadm5_pool; ent; ent = ent->next) {
+		if (ent->hndl == hndl && !ent->invalid) {
+			ent->invalid = 1;
+			kadm5_pool_counters.invalidated++;
+		}
+	}
+}
+
+/*
+ * kadm5_pool_error() is called with the result of each call made on a
+ * pooled handle and returns it.  Errors which mean that the handle or
+ * its connexion to the database has failed invalidate the handle so
+ * that kadm5_pool_get() will build a new one.  The com_err convention
+ * is that codes below 256 are errno values and so they are from the
+ * database or the system.  Errors about the request itself, such as an
+ * unknown principal, leave the handle in the pool.
+ */
+
+static kadm5_ret_t
+kadm5_pool_error(kadm5_handle hndl, kadm5_ret_t ret)
+{
+
+	switch (ret) {
+	case 0:
+		return ret;
+	case KADM5_FAILURE:
+	case KADM5_BAD_DB:
+	case KADM5_RPC_ERROR:
+	case KADM5_NOT_INIT:
+	case KADM5_BAD_SERVER_HANDLE:
+	case KADM5_GSS_ERROR:
+		break;
+	default:
+		if (ret < 0 || ret >= 256)
+			return ret;
+		break;
+	}
+
+	kadm5_pool_invalidate(hndl);
+	return ret;
+}
+
+kadm5_pool_stats
+kadm5_pool_get_stats(void)
+{
+	kadm5_pool_stats	 stats = kadm5_pool_counters;
+	struct kadm5_pool_ent	*ent;
+
+	stats.idle = 0;
+	stats.in_use = 0;
+	for (ent = kadm5_pool; ent; ent = ent->next) {
+		if (ent->in_use)
+			stats.in_use++;
+		else
+			stats.idle++;
+	}
+
+	return stats;
+}
+
+/*
+ * Principal parsing cache.  We often parse the same few principals many
+ * times in a single request and so we keep a bounded LRU of parsed
+ * principals per krb5_context, keyed on the supplied string.  Each entry
+ * holds the components (realm first) and the canonical string from
+ * krb5_unparse_name().  The entries are owned by the cache and are only
+ * valid until the next call, which is fine for the Perl typemaps which
+ * copy them straight away.  The cache is freed with the context.
+ */
+
+#define PRINC_CACHE_SIZE	256
+#define PRINC_CACHE_BUCKETS	509
+
+struct princ_cache {
+	krb5_context		 ctx;
+	int			 count;
+	struct _parsed_princ	*buckets[PRINC_CACHE_BUCKETS];
+	struct _parsed_princ	*head;		/* most recently used */
+	struct _parsed_princ	*tail;		/* least recently used */
+	struct princ_cache	*next;
+};
+
+static struct princ_cache	*princ_caches = NULL;
+
+static unsigned int
+princ_hash(const char *str)
+{
+	unsigned int	h = 5381;
+
+	while (*str)
+		h = h * 33 + (unsigned char)*str++;
+	return h % PRINC_CACHE_BUCKETS;
+}
+
+static void
+parsed_princ_free(struct _parsed_princ *p)
+{
+	int	i;
+
+	if (!p)
+		return;
+	if (p->comps)
+		for (i = 0; i < p->ncomps; i++)
+			free(p->comps[i]);
+	free(p->comps);
+	free(p->lens);
+	free(p->canon);
+	free(p->name);
+	free(p);
+}
+
+static struct princ_cache *
+princ_cache_get(krb5_context ctx)
+{
+	struct princ_cache	*pc;
+
+	for (pc = princ_caches; pc; pc = pc->next)
+		if (pc->ctx == ctx)
+			return pc;
+
+	pc = calloc(1, sizeof(*pc));
+	if (!pc)
+		return NULL;
+	pc->ctx = ctx;
+	pc->next = princ_caches;
+	princ_caches = pc;
+	return pc;
+}
+
+static void
+princ_cache_free(krb5_context ctx)
+{
+	struct princ_cache	**pcp;
+	struct princ_cache	 *pc;
+	struct _parsed_princ	 *p;
+
+	for (pcp = &princ_caches; *pcp; pcp = &(*pcp)->next)
+		if ((*pcp)->ctx == ctx)
+			break;
+
+	if (!*pcp)
+		return;
+
+	pc = *pcp;
+	*pcp = pc->next;
+	while ((p = pc->head) != NULL) {
+		pc->head = p->next;
+		parsed_princ_free(p);
+	}
+	free(pc);
+}
+
+static void
+princ_cache_unlink(struct princ_cache *pc, struct _parsed_princ *p)
+{
+
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		pc->head = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+	else
+		pc->tail = p->prev;
+	p->prev = p->next = NULL;
+}
+
+static void
+princ_cache_push(struct princ_cache *pc, struct _parsed_princ *p)
+{
+
+	p->next = pc->head;
+	if (pc->head)
+		pc->head->prev = p;
+	pc->head = p;
+	if (!pc->tail)
+		pc->tail = p;
+}
+
+static void
+princ_cache_evict(struct princ_cache *pc)
+{
+	struct _parsed_princ	**pp;
+	struct _parsed_princ	 *p = pc->tail;
+
+	princ_cache_unlink(pc, p);
+	for (pp = &pc->buckets[princ_hash(p->name)]; *pp; pp = &(*pp)->hnext) {
+		if (*pp == p) {
+			*pp = p->hnext;
+			break;
+		}
+	}
+	parsed_princ_free(p);
+	pc->count--;
+}
+
+static struct _parsed_princ *
+parsed_princ_new(krb5_context ctx, const char *name, char *croakstr,
+		 size_t croaklen)
+{
+	struct _parsed_princ	*p = NULL;
+	krb5_principal		 princ = NULL;
+	krb5_error_code		 ret;
+	const char		*fn = "krb5_parse_name";
+	const char		*tmp;
+	int			 i;
+
+	ret = krb5_parse_name(ctx, name, &princ);
+	if (!ret) {
+		p = calloc(1, sizeof(*p));
+		ret = p ? 0 : ENOMEM;
+	}
+	if (!ret) {
+		p->ncomps = PRINC_NCOMPS(ctx, princ) + 1;
+		p->comps = calloc(p->ncomps, sizeof(*p->comps));
+		p->lens = calloc(p->ncomps, sizeof(*p->lens));
+		p->name = strdup(name);
+		if (!p->comps || !p->lens || !p->name)
+			ret = ENOMEM;
+	}
+	for (i = 0; !ret && i < p->ncomps; i++) {
+		if (i == 0) {
+			tmp = PRINC_REALM(ctx, princ);
+			p->lens[i] = PRINC_REALM_LEN(ctx, princ);
+		} else {
+			tmp = PRINC_COMP(ctx, princ, i - 1);
+			p->lens[i] = PRINC_COMP_LEN(ctx, princ, i - 1);
+		}
+		p->comps[i] = malloc(p->lens[i] + 1);
+		if (!p->comps[i]) {
+			ret = ENOMEM;
+			break;
+		}
+		memcpy(p->comps[i], tmp, p->lens[i]);
+		p->comps[i][p->lens[i]] = '\0';
+	}
+	if (!ret) {
+		fn = "krb5_unparse_name";
+		ret = krb5_unparse_name(ctx, princ, &p->canon);
+	}
+
+	if (princ)
+		krb5_free_principal(ctx, princ);
+
+	if (ret) {
+#ifdef HAVE_HEIMDAL
+		tmp = krb5_get_error_message(ctx, ret);
+		if (tmp) {
+			snprintf(croakstr, croaklen, "%s: %s", fn, tmp);
+			krb5_free_error_message(ctx, tmp);
+		} else {
+			snprintf(croakstr, croaklen, "%s: unknown error", fn);
+		}
+#else
+		snprintf(croakstr, croaklen, "%s: %s", fn, error_message(ret));
+#endif
+		if (p)
+			parsed_princ_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+parsed_princ
+parse_name(krb5_context ctx, char *name)
+{
+	struct princ_cache	*pc;
+	struct _parsed_princ	*p;
+	unsigned int		 h = princ_hash(name);
+	char			 croakstr[2048] = "";
+
+	pc = princ_cache_get(ctx);
+	if (!pc)
+		croak("parse_name: out of memory");
+
+	for (p = pc->buckets[h]; p; p = p->hnext) {
+		if (!strcmp(p->name, name)) {
+			princ_cache_unlink(pc, p);
+			princ_cache_push(pc, p);
+			return p;
+		}
+	}
+
+	p = parsed_princ_new(ctx, name, croakstr, sizeof(croakstr));
+	if (!p)
+		croak("%s", croakstr);
+
+	if (pc->count >= PRINC_CACHE_SIZE)
+		princ_cache_evict(pc);
+
+	p->hnext = pc->buckets[h];
+	pc->buckets[h] = p;
+	princ_cache_push(pc, p);
+	pc->count++;
+
+	return p;
+}
+
+canon_princ
+parse_name_canon(krb5_context ctx, char *name)
+{
+
+	return parse_name(ctx, name);
+}
+
+/*
+ * unparse_name() builds the canonical string for a principal from its
+ * components (realm first), quoting them as krb5_unparse_name() would.
+ */
+
+char *
+unparse_name(krb5_context ctx, int ncomps, char **comps)
+{
+	const char	*c;
+	char		*ret;
+	char		*r;
+	size_t		 len = 2;
+	int		 i;
+
+	if (ncomps < 1)
+		croak("unparse_name: a principal must have a realm");
+
+	for (i = 0; i < ncomps; i++)
+		len += 2 * strlen(comps[i]) + 1;
+
+	ret = r = malloc(len);
+	if (!ret)
+		croak("unparse_name: out of memory");
+
+	for (i = 1; i <= ncomps; i++) {
+		if (i == ncomps) {
+			*r++ = '@';
+			c = comps[0];
+		} else {
+			if (i > 1)
+				*r++ = '/';
+			c = comps[i];
+		}
+
+		for (; *c; c++) {
+			switch (*c) {
+			case '/':
+				if (i == ncomps) {
+					*r++ = *c;
+					continue;
+				}
+				/* FALLTHROUGH */
+			case '@':
+			case '\\':
+				*r++ = '\\';
+				*r++ = *c;
+				break;
+			case '\n':
+				*r++ = '\\';
+				*r++ = 'n';
+				break;
+			case '\t':
+				*r++ = '\\';
+				*r++ = 't';
+				break;
+			case '\b':
+				*r++ = '\\';
+				*r++ = 'b';
+				break;
+			default:
+				*r++ = *c;
+			}
+		}
+	}
+	*r = '\0';
+
+	return ret;
+}
+
 void
 my_free_ctx(krb5_context *ctx)
 {
 
+	princ_cache_free(*ctx);
 	krb5_free_context(*ctx);
 	free(ctx);
 }
@@ -112,7 +705,7 @@ krb5_query_princ(krb5_context ctx, kadm5_handle hndl, char *in)
 	memset(&dprinc, 0, sizeof(dprinc));
 
 	K5BAIL(krb5_parse_name(ctx, in, &princ));
-	K5BAIL(kadm5_get_principal(hndl, princ, &dprinc, 
+	KADM5BAIL(kadm5_get_principal(hndl, princ, &dprinc, 
 	    KADM5_PRINCIPAL_NORMAL_MASK));
 
 done:
@@ -232,7 +825,7 @@ krb5_createprinc(krb5_context ctx, kadm5_handle hndl,
 		croak("Out of memory.");
 
 	mask |= KADM5_PRINCIPAL;
-	K5BAIL(kadm5_create_principal_3(hndl, &p, mask, n_ks_tuple, ks_tuple,
+	KADM5BAIL(kadm5_create_principal_3(hndl, &p, mask, n_ks_tuple, ks_tuple,
 	    passwd));
 
 done:
@@ -251,7 +844,7 @@ krb5_modprinc(krb5_context ctx, kadm5_handle hndl, kadm5_principal_ent_rec p,
 	kadm5_ret_t	ret;
 	char		croakstr[256] = "";
 
-	K5BAIL(kadm5_modify_principal(hndl, &p, mask));
+	KADM5BAIL(kadm5_modify_principal(hndl, &p, mask));
 
 done:
 	if (ret)
@@ -266,7 +859,7 @@ krb5_deleteprinc(krb5_context ctx, kadm5_handle hndl, char *in)
 	char		croakstr[2048] = "";
 
 	K5BAIL(krb5_parse_name(ctx, in, &princ));
-	K5BAIL(kadm5_delete_principal(hndl, princ));
+	KADM5BAIL(kadm5_delete_principal(hndl, princ));
 
 done:
 	/* XXXrcd: free the princ. */
@@ -419,7 +1012,7 @@ krb5_getkey(krb5_context ctx, kadm5_handle hndl, char *in)
 	memset(&dprinc, 0, sizeof(dprinc));
 
 	K5BAIL(krb5_parse_name(ctx, in, &princ));
-	K5BAIL(kadm5_get_principal(hndl, princ, &dprinc, 
+	KADM5BAIL(kadm5_get_principal(hndl, princ, &dprinc, 
 	    KADM5_PRINCIPAL_NORMAL_MASK | KADM5_KEY_DATA));
 
 	for (i=0; i < dprinc.n_key_data; i++) {
@@ -504,7 +1097,7 @@ krb5_createkey(krb5_context ctx, kadm5_handle hndl, char *in)
 
 	dprinc.principal = princ;
 	dprinc.attributes = KRB5_KDB_DISALLOW_ALL_TIX;
-	K5BAIL(kadm5_create_principal(hndl, &dprinc, KADM5_PRINCIPAL|
+	KADM5BAIL(kadm5_create_principal(hndl, &dprinc, KADM5_PRINCIPAL|
 	     KADM5_ATTRIBUTES, dummybuf));
 
 #if HAVE_MIT
@@ -521,15 +1114,15 @@ krb5_createkey(krb5_context ctx, kadm5_handle hndl, char *in)
 	enctypes[3].ks_enctype  = ENCTYPE_DES3_CBC_SHA1;
 	enctypes[3].ks_salttype = 0;
 
-	K5BAIL(kadm5_randkey_principal_3(hndl, dprinc.principal, 0,
+	KADM5BAIL(kadm5_randkey_principal_3(hndl, dprinc.principal, 0,
 	    4, enctypes, NULL, NULL));
 #else
-	K5BAIL(kadm5_randkey_principal_3(hndl, dprinc.principal, 0,
+	KADM5BAIL(kadm5_randkey_principal_3(hndl, dprinc.principal, 0,
 	    0, 0, NULL, NULL));
 #endif
 
 	dprinc.attributes &= ~KRB5_KDB_DISALLOW_ALL_TIX;
-	K5BAIL(kadm5_modify_principal(hndl, &dprinc, KADM5_ATTRIBUTES));
+	KADM5BAIL(kadm5_modify_principal(hndl, &dprinc, KADM5_ATTRIBUTES));
 
 done:
 	/* XXXrcd: free up used data structures! */
@@ -571,7 +1164,7 @@ is_next_kvno(krb5_context ctx, kadm5_handle hndl, krb5_principal princ,
 	if (kvno < 2)
 		return 1;
 
-	K5BAIL(kadm5_get_principal(hndl, princ, &dprinc, 
+	KADM5BAIL(kadm5_get_principal(hndl, princ, &dprinc, 
 	    KADM5_PRINCIPAL_NORMAL_MASK | KADM5_KEY_DATA));
 
 	if (max_kvno(dprinc) != (kvno - 1)) {
@@ -618,7 +1211,7 @@ krb5_setkey(krb5_context ctx, kadm5_handle hndl, char *in, int kvno,
 #endif /* HAVE_HEIMDAL */
 
 	K5BAIL(krb5_parse_name(ctx, in, &princ));
-	K5BAIL(kadm5_lock(hndl));
+	KADM5BAIL(kadm5_lock(hndl));
 	locked = 1;
 
 	if (!is_next_kvno(ctx, hndl, princ, kvno, croakstr, sizeof(croakstr))) {
@@ -626,7 +1219,7 @@ krb5_setkey(krb5_context ctx, kadm5_handle hndl, char *in, int kvno,
 		goto done;
 	}
 
-	K5BAIL(kadm5_setkey_principal_3(hndl, princ, TRUE, 0, NULL,
+	KADM5BAIL(kadm5_setkey_principal_3(hndl, princ, TRUE, 0, NULL,
 	    keys, n_keys));
 
 done:
@@ -659,7 +1252,7 @@ krb5_randpass(krb5_context ctx, kadm5_handle hndl, char *in, int n_ks_tuple,
 
 	passwd = random_passwd(ctx, PROID_PASSWD_SIZE);
 	K5BAIL(krb5_parse_name(ctx, in, &princ));
-	K5BAIL(kadm5_chpass_principal_3(hndl, princ, FALSE, n_ks_tuple,
+	KADM5BAIL(kadm5_chpass_principal_3(hndl, princ, FALSE, n_ks_tuple,
 	    ks_tuple, passwd));
 
 done:
@@ -683,7 +1276,7 @@ krb5_setpass(krb5_context ctx, kadm5_handle hndl, char *in, int kvno,
 	char			croakstr[2048] = "";
 
 	K5BAIL(krb5_parse_name(ctx, in, &princ));
-	K5BAIL(kadm5_lock(hndl));
+	KADM5BAIL(kadm5_lock(hndl));
 	locked = 1;
 
 	if (!is_next_kvno(ctx, hndl, princ, kvno, croakstr, sizeof(croakstr))) {
@@ -691,7 +1284,7 @@ krb5_setpass(krb5_context ctx, kadm5_handle hndl, char *in, int kvno,
 		goto done;
 	}
 
-	K5BAIL(kadm5_chpass_principal_3(hndl, princ, FALSE, n_ks_tuple,
+	KADM5BAIL(kadm5_chpass_principal_3(hndl, princ, FALSE, n_ks_tuple,
 	    ks_tuple, passwd));
 
 done:
@@ -729,10 +1322,10 @@ krb5_randkey(krb5_context ctx, kadm5_handle hndl, char *in)
 	enctypes[0].ks_enctype  = ENCTYPE_AES256_CTS_HMAC_SHA1_96;
 	enctypes[0].ks_salttype = 0;
 
-	K5BAIL(kadm5_randkey_principal_3(hndl, princ, FALSE, 1, enctypes,
+	KADM5BAIL(kadm5_randkey_principal_3(hndl, princ, FALSE, 1, enctypes,
 	    NULL, NULL));
 #else
-	K5BAIL(kadm5_randkey_principal_3(hndl, princ, FALSE, 0, NULL,
+	KADM5BAIL(kadm5_randkey_principal_3(hndl, princ, FALSE, 0, NULL,
 	    NULL, NULL));
 #endif
 
@@ -913,46 +1506,289 @@ done:
 	return realm;
 }
 
-char **
-krb5_get_kdcs(krb5_context ctx, char *realm)
-{
-	krb5_error_code	  ret;
-	char		 *def_realm = NULL;
-	char		**hostlist = NULL;
-	char		  croakstr[2048] = "";
+/*
+ * KDC discovery cache.  krb5_get_krbhst() may well involve DNS SRV
+ * lookups and so we cache the normalised results per realm for
+ * kdc_cache_ttl seconds.  The cache is kept in memory and, if a file has
+ * been configured with krb5_kdc_cache_config(), also on disk so that it
+ * is shared by short-lived processes.  The file contains lines of the
+ * form ``realm expiry host ...'' and is ignored unless it is owned by us
+ * and cannot be written by group or others.
+ */
 
-#ifdef HAVE_HEIMDAL
-	char		**hlist;
-	char		 *tmp;
-#endif
+#define KDC_CACHE_TTL	300
 
-#ifdef HAVE_MIT
-	krb5_data	  realm_data;
-#endif /* HAVE_MIT */
+struct kdc_cache_ent {
+	char			 *realm;
+	char			**hosts;
+	time_t			  expires;
+	struct kdc_cache_ent	 *next;
+};
 
-	if (!realm || !realm[0]) {
-		K5BAIL(krb5_get_default_realm(ctx, &def_realm));
-		realm = def_realm;
-	}
+static struct kdc_cache_ent	*kdc_cache = NULL;
+static char			*kdc_cache_file = NULL;
+static int			 kdc_cache_ttl = KDC_CACHE_TTL;
 
-#ifdef HAVE_HEIMDAL
-	K5BAIL(krb5_get_krbhst(ctx, &realm, &hostlist));
+static void
+free_hostlist(char **hosts)
+{
+	char	**h;
 
-	/* XXXrcd: Heidmal includes protocol and port in the output
-	 *         and so we need to strip that out.
-	 */
+	if (!hosts)
+		return;
+	for (h = hosts; *h; h++)
+		free(*h);
+	free(hosts);
+}
 
-	for (hlist=hostlist; *hlist; hlist++) {
-		tmp = strrchr(*hlist, ':');
-		if (tmp)
+static int
+add_host(char ***hosts, int *n, const char *host)
+{
+	char	**tmp;
+
+	tmp = realloc(*hosts, (*n + 2) * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+	*hosts = tmp;
+	tmp[*n] = strdup(host);
+	if (!tmp[*n])
+		return -1;
+	tmp[++*n] = NULL;
+	return 0;
+}
+
+/*
+ * krb5_kdc_cache_config() sets the cache file (or NULL for none) and the
+ * TTL.  If either changes, we flush the in-memory cache.
+ */
+
+void
+krb5_kdc_cache_config(char *file, int ttl)
+{
+	struct kdc_cache_ent	*ent;
+
+	if (ttl < 0)
+		ttl = kdc_cache_ttl;
+
+	if (ttl == kdc_cache_ttl && (file && kdc_cache_file ?
+	    !strcmp(file, kdc_cache_file) : file == kdc_cache_file))
+		return;
+
+	while ((ent = kdc_cache) != NULL) {
+		kdc_cache = ent->next;
+		free_hostlist(ent->hosts);
+		free(ent->realm);
+		free(ent);
+	}
+
+	free(kdc_cache_file);
+	kdc_cache_file = NULL;
+	if (file)
+		kdc_cache_file = strdup(file);
+	kdc_cache_ttl = ttl;
+}
+
+/*
+ * Heimdal includes the protocol and port in the output of
+ * krb5_get_krbhst() and so we strip them out here, once, before caching.
+ */
+
+static char **
+kdc_normalise(char **hostlist)
+{
+	char	**hosts = NULL;
+	char	 *tmp;
+	char	  buf[1024];
+	int	  n = 0;
+
+	for (; *hostlist; hostlist++) {
+		tmp = strrchr(*hostlist, '/');
+		snprintf(buf, sizeof(buf), "%s", tmp ? tmp + 1 : *hostlist);
+		tmp = strrchr(buf, ':');
+		if (tmp)
 			*tmp = '\0';
-		tmp = strrchr(*hlist, '/');
-		if (tmp) {
-			tmp = strdup(tmp+1);
-			free(*hlist);
-			*hlist = tmp;
+		for (tmp = buf; *tmp; tmp++)
+			*tmp = tolower((unsigned char)*tmp);
+		if (add_host(&hosts, &n, buf)) {
+			free_hostlist(hosts);
+			return NULL;
 		}
 	}
+
+	if (!hosts)
+		hosts = calloc(1, sizeof(*hosts));
+	return hosts;
+}
+
+static char **
+kdc_cache_file_read(const char *realm, time_t now, time_t *expires)
+{
+	struct stat	  st;
+	FILE		 *f;
+	char		**hosts = NULL;
+	char		  line[4096];
+	char		 *last;
+	char		 *tok;
+	int		  n = 0;
+
+	f = fopen(kdc_cache_file, "r");
+	if (!f)
+		return NULL;
+
+	if (fstat(fileno(f), &st) == -1 || st.st_uid != getuid() ||
+	    (st.st_mode & 022)) {
+		fclose(f);
+		return NULL;
+	}
+
+	while (!hosts && fgets(line, sizeof(line), f)) {
+		if (!strchr(line, '\n'))
+			break;
+
+		tok = strtok_r(line, " \n", &last);
+		if (!tok || strcmp(tok, realm))
+			continue;
+		tok = strtok_r(NULL, " \n", &last);
+		if (!tok || (*expires = strtol(tok, NULL, 10)) <= now)
+			continue;
+
+		while ((tok = strtok_r(NULL, " \n", &last)) != NULL) {
+			if (add_host(&hosts, &n, tok)) {
+				free_hostlist(hosts);
+				hosts = NULL;
+				break;
+			}
+		}
+	}
+
+	fclose(f);
+	return hosts;
+}
+
+static void
+kdc_cache_file_write(const char *realm, char **hosts, time_t expires,
+		     time_t now)
+{
+	FILE	 *in;
+	FILE	 *out;
+	char	  tmpname[1024];
+	char	  line[4096];
+	char	  copy[4096];
+	char	 *last;
+	char	 *tok;
+	int	  fd;
+	int	  ok;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%ld", kdc_cache_file,
+	    (long)getpid());
+
+	fd = open(tmpname, O_CREAT|O_EXCL|O_WRONLY, 0600);
+	if (fd == -1)
+		return;
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		unlink(tmpname);
+		return;
+	}
+
+	/* We keep the other realms' unexpired entries */
+	in = fopen(kdc_cache_file, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (!strchr(line, '\n'))
+			break;
+		strcpy(copy, line);
+		tok = strtok_r(copy, " \n", &last);
+		if (!tok || !strcmp(tok, realm))
+			continue;
+		tok = strtok_r(NULL, " \n", &last);
+		if (!tok || strtol(tok, NULL, 10) <= now)
+			continue;
+		fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+
+	fprintf(out, "%s %ld", realm, (long)expires);
+	for (; *hosts; hosts++)
+		fprintf(out, " %s", *hosts);
+	fprintf(out, "\n");
+
+	ok = !ferror(out);
+	if (fclose(out) || !ok || rename(tmpname, kdc_cache_file) == -1)
+		unlink(tmpname);
+}
+
+static struct kdc_cache_ent *
+kdc_cache_store(const char *realm, char **hosts, time_t expires)
+{
+	struct kdc_cache_ent	*ent;
+
+	for (ent = kdc_cache; ent; ent = ent->next)
+		if (!strcmp(ent->realm, realm))
+			break;
+
+	if (!ent) {
+		ent = calloc(1, sizeof(*ent));
+		if (!ent)
+			return NULL;
+		ent->realm = strdup(realm);
+		if (!ent->realm) {
+			free(ent);
+			return NULL;
+		}
+		ent->next = kdc_cache;
+		kdc_cache = ent;
+	}
+
+	free_hostlist(ent->hosts);
+	ent->hosts = hosts;
+	ent->expires = expires;
+	return ent;
+}
+
+/*
+ * The list returned by krb5_get_kdcs() belongs to the cache and remains
+ * valid until the next call for the same realm.
+ */
+
+char **
+krb5_get_kdcs(krb5_context ctx, char *realm)
+{
+	struct kdc_cache_ent	 *ent = NULL;
+	krb5_error_code		  ret = 0;
+	time_t			  now = time(NULL);
+	time_t			  expires;
+	char			 *def_realm = NULL;
+	char			**hostlist = NULL;
+	char			**hosts = NULL;
+	char			  croakstr[2048] = "";
+
+#ifdef HAVE_MIT
+	krb5_data		  realm_data;
+#endif /* HAVE_MIT */
+
+	if (!realm || !realm[0]) {
+		K5BAIL(krb5_get_default_realm(ctx, &def_realm));
+		realm = def_realm;
+	}
+
+	for (ent = kdc_cache; ent; ent = ent->next)
+		if (!strcmp(ent->realm, realm) && ent->expires > now)
+			goto done;
+
+	if (kdc_cache_file && kdc_cache_ttl > 0) {
+		hosts = kdc_cache_file_read(realm, now, &expires);
+		if (hosts) {
+			ent = kdc_cache_store(realm, hosts, expires);
+			if (!ent)
+				free_hostlist(hosts);
+			goto done;
+		}
+	}
+
+#ifdef HAVE_HEIMDAL
+	K5BAIL(krb5_get_krbhst(ctx, &realm, &hostlist));
 #else
 #ifdef HAVE_MIT
 	realm_data.data = realm;
@@ -961,15 +1797,29 @@ krb5_get_kdcs(krb5_context ctx, char *realm)
 #endif /* HAVE_MIT */
 #endif /* HAVE_HEIMDAL */
 
+	hosts = kdc_normalise(hostlist);
+	if (!hosts)
+		BAIL(ENOMEM, "out of memory");
+
+	ent = kdc_cache_store(realm, hosts, now + kdc_cache_ttl);
+	if (!ent) {
+		free_hostlist(hosts);
+		BAIL(ENOMEM, "out of memory");
+	}
+
+	if (kdc_cache_file && kdc_cache_ttl > 0)
+		kdc_cache_file_write(realm, hosts, ent->expires, now);
+
 done:
+	if (hostlist)
+		krb5_free_krbhst(ctx, hostlist);
+
 	if (def_realm)
 		krb5_free_default_realm(ctx, def_realm);
 
-	if (ret) {
-		/* XXX free host list? */
+	if (ret || !ent)
 		return NULL;
-	}
-	return hostlist;
+	return ent->hosts;
 }
 
 void
@@ -1255,7 +2105,7 @@ krb5_list_pols(krb5_context ctx, kadm5_handle hndl, char *exp)
         int               count;
 	int		  i;
 
-	K5BAIL(kadm5_get_policies(hndl, exp, &pols, &count));
+	KADM5BAIL(kadm5_get_policies(hndl, exp, &pols, &count));
 
 	/* We must null terminate the string because of our typemap. */
 	out = malloc((count + 1) * sizeof(*out));
@@ -1294,7 +2144,7 @@ krb5_list_princs(krb5_context ctx, kadm5_handle hndl, char *exp)
         int               count;
 	int		  i;
 
-        K5BAIL(kadm5_get_principals(hndl, exp, &princs, &count));
+        KADM5BAIL(kadm5_get_principals(hndl, exp, &princs, &count));
 
 	/* We must null terminate the string because of our typemap. */
 	out = malloc((count + 1) * sizeof(*out));
@@ -1351,6 +2201,235 @@ done:
 		croak("%s", croakstr);
 }
 
+/*
+ * read_ccache_tgt() returns the client principal of a ccache and the
+ * endtime of its TGT.  This is the state that krb5_prestash sends to
+ * fetch_tickets() so that only the tickets which need to be replaced
+ * are minted.  A ccache which does not exist or which does not contain
+ * a TGT simply has no state and so we return NULL rather than croak.
+ */
+
+ccache_state
+read_ccache_tgt(krb5_context ctx, char *ccname)
+{
+	krb5_ccache		 ccache = NULL;
+	krb5_principal		 client = NULL;
+	krb5_principal		 tgs = NULL;
+	krb5_creds		 mcreds;
+	krb5_creds		 creds;
+	ccache_state		 state = NULL;
+	char			*princ = NULL;
+	krb5_error_code		 ret = 0;
+	char			 croakstr[2048] = "";
+
+	memset(&mcreds, 0x0, sizeof(mcreds));
+	memset(&creds, 0x0, sizeof(creds));
+
+	K5BAIL(krb5_cc_resolve(ctx, ccname, &ccache));
+
+	if (krb5_cc_get_principal(ctx, ccache, &client))
+		goto done;
+
+	K5BAIL(krb5_build_principal(ctx, &tgs, PRINC_REALM_LEN(ctx, client),
+	    PRINC_REALM(ctx, client), KRB5_TGS_NAME, PRINC_REALM(ctx, client),
+	    NULL));
+
+	mcreds.client = client;
+	mcreds.server = tgs;
+
+	if (krb5_cc_retrieve_cred(ctx, ccache, 0, &mcreds, &creds))
+		goto done;
+
+	K5BAIL(krb5_unparse_name(ctx, client, &princ));
+
+	state = malloc(sizeof(*state));
+	if (!state)
+		BAIL(ENOMEM, "out of memory");
+
+	state->princ = princ;
+	state->endtime = creds.times.endtime;
+	princ = NULL;
+
+	krb5_free_cred_contents(ctx, &creds);
+
+done:
+	free(princ);
+	if (tgs)
+		krb5_free_principal(ctx, tgs);
+	if (client)
+		krb5_free_principal(ctx, client);
+	if (ccache)
+		krb5_cc_close(ctx, ccache);
+
+	if (ret)
+		croak("%s", croakstr);
+
+	return state;
+}
+
+/*
+ * ccache_holds() returns true if the ccache in the file path is owned
+ * by uid and contains exactly creds and nothing else.  It does not
+ * write anything and any error simply means that the ccache must be
+ * replaced.
+ */
+
+static int
+ccache_holds(krb5_context ctx, char *path, krb5_creds *creds, int uid)
+{
+	krb5_ccache	 ccache = NULL;
+	krb5_principal	 client = NULL;
+	krb5_cc_cursor	 cursor;
+	krb5_creds	 c;
+	struct stat	 sb;
+	char		 ccname[MAXPATHLEN + 6];
+	int		 seq = 0;
+	int		 found = 0;
+	int		 same = 0;
+
+	if (stat(path, &sb) == -1 || sb.st_uid != (uid_t)uid)
+		return 0;
+
+	snprintf(ccname, sizeof(ccname), "FILE:%s", path);
+	if (krb5_cc_resolve(ctx, ccname, &ccache))
+		return 0;
+
+	if (krb5_cc_get_principal(ctx, ccache, &client) ||
+	    !krb5_principal_compare(ctx, client, creds->client))
+		goto done;
+
+	if (krb5_cc_start_seq_get(ctx, ccache, &cursor))
+		goto done;
+	seq = 1;
+
+	same = 1;
+	while (same && !krb5_cc_next_cred(ctx, ccache, &cursor, &c)) {
+		if (krb5_is_config_principal(ctx, c.server)) {
+			krb5_free_cred_contents(ctx, &c);
+			continue;
+		}
+
+		same = !found &&
+		    krb5_principal_compare(ctx, c.server, creds->server) &&
+		    c.times.authtime == creds->times.authtime &&
+		    c.times.starttime == creds->times.starttime &&
+		    c.times.endtime == creds->times.endtime &&
+		    c.times.renew_till == creds->times.renew_till &&
+		    CREDS_FLAGS(c) == CREDS_FLAGS(*creds) &&
+		    CREDS_KEYBLOCK_ENCTYPE(c) ==
+			CREDS_KEYBLOCK_ENCTYPE(*creds) &&
+		    CREDS_KEYBLOCK_CONTENT_LEN(c) ==
+			CREDS_KEYBLOCK_CONTENT_LEN(*creds) &&
+		    !memcmp(CREDS_KEYBLOCK_CONTENTS(c),
+			CREDS_KEYBLOCK_CONTENTS(*creds),
+			CREDS_KEYBLOCK_CONTENT_LEN(c)) &&
+		    c.ticket.length == creds->ticket.length &&
+		    !memcmp(c.ticket.data, creds->ticket.data,
+			c.ticket.length);
+		found = 1;
+
+		krb5_free_cred_contents(ctx, &c);
+	}
+
+done:
+	if (seq)
+		krb5_cc_end_seq_get(ctx, ccache, &cursor);
+	if (client)
+		krb5_free_principal(ctx, client);
+	krb5_cc_close(ctx, ccache);
+
+	return same && found;
+}
+
+/*
+ * store_ccache() replaces the ccache in the file path with one that
+ * contains only creds, owned by uid and gid.  If the ccache already
+ * holds exactly these credentials then we write nothing at all.
+ * Otherwise the new ccache is written to a temporary file in the same
+ * directory which is fsync(2)ed and then rename(2)ed into place so that
+ * a reader never sees a partially written ccache.  We return 1 if the
+ * ccache was replaced and 0 if it was left alone.
+ */
+
+int
+store_ccache(krb5_context ctx, char *path, krb5_creds *creds, int uid,
+	     int gid)
+{
+	krb5_ccache	 ccache = NULL;
+	krb5_error_code	 ret = 0;
+	char		 croakstr[2048] = "";
+	char		 tmp[MAXPATHLEN];
+	char		 ccname[MAXPATHLEN + 6];
+	char		*slash;
+	int		 fd = -1;
+	int		 written = 0;
+
+	tmp[0] = '\0';
+
+	if (ccache_holds(ctx, path, creds, uid))
+		return 0;
+
+	/*
+	 * The temporary file starts with a dot so that it is not mistaken
+	 * for a ccache if we are interrupted.
+	 */
+
+	slash = strrchr(path, '/');
+	if (snprintf(tmp, sizeof(tmp), "%.*s.ccache.XXXXXX",
+	    slash ? (int)(slash - path + 1) : 0, path) >= (int)sizeof(tmp)) {
+		tmp[0] = '\0';
+		BAIL(ENAMETOOLONG, "path too long");
+	}
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		tmp[0] = '\0';
+		BAIL(errno, strerror(errno));
+	}
+	close(fd);
+	fd = -1;
+
+	snprintf(ccname, sizeof(ccname), "FILE:%s", tmp);
+	K5BAIL(krb5_cc_resolve(ctx, ccname, &ccache));
+	K5BAIL(krb5_cc_initialize(ctx, ccache, creds->client));
+	K5BAIL(krb5_cc_store_cred(ctx, ccache, creds));
+	krb5_cc_close(ctx, ccache);
+	ccache = NULL;
+
+	/*
+	 * krb5_cc_initialize() may have replaced our file and so we only
+	 * set its owner and mode once it has been written.
+	 */
+
+	fd = open(tmp, O_RDONLY);
+	if (fd == -1)
+		BAIL(errno, strerror(errno));
+	if (fchown(fd, uid, gid) == -1)
+		BAIL(errno, strerror(errno));
+	if (fchmod(fd, 0600) == -1)
+		BAIL(errno, strerror(errno));
+	if (fsync(fd) == -1)
+		BAIL(errno, strerror(errno));
+
+	if (rename(tmp, path) == -1)
+		BAIL(errno, strerror(errno));
+	tmp[0] = '\0';
+	written = 1;
+
+done:
+	if (fd != -1)
+		close(fd);
+	if (ccache)
+		krb5_cc_close(ctx, ccache);
+	if (tmp[0])
+		unlink(tmp);
+
+	if (ret)
+		croak("%s", croakstr);
+
+	return written;
+}
+
 #ifdef HAVE_HEIMDAL
 
 #undef warn		/* Conflict between Perl and <err.h> via <hdb.h> */
@@ -1405,7 +2484,7 @@ mint_ticket(krb5_context ctx, kadm5_handle hndl, char *princ, int lifetime,
 	K5BAIL(krb5_make_principal(ctx, &krbtgt, client_realm, KRB5_TGS_NAME,
 	    client_realm, NULL));
 
-	K5BAIL(kadm5_get_principal(hndl, krbtgt, &dprinc, 
+	KADM5BAIL(kadm5_get_principal(hndl, krbtgt, &dprinc, 
 	    KADM5_PRINCIPAL_NORMAL_MASK | KADM5_KEY_DATA));
 
 	for (i=0; i < dprinc.n_key_data; i++) {
@@ -1522,6 +2601,271 @@ init_kdb(krb5_context ctx, kadm5_handle hndl)
 	db->hdb_close(ctx, db);
 	return 0;
 }
+
+/*
+ * kadm5_log_file() returns the name of the kadm5 log to which an entry
+ * is appended for each change made through kadm5 to the database behind
+ * hndl, whether by us, kadmin or kpasswdd.  The name comes from the
+ * configuration of the realm's database and so we cannot guess it.
+ */
+
+const char *
+kadm5_log_file(krb5_context ctx, kadm5_handle hndl)
+{
+	kadm5_server_context	*sctx = hndl;
+
+	if (!sctx)
+		return NULL;
+	return sctx->log_context.log_file;
+}
+
+/*
+ * export_kdb() streams each of the principals in the KDB to fd as a
+ * record of the snapshot format described in Krb5Admin::Snapshot, i.e.
+ * a 32 bit big endian length followed by the DER encoding of the entry.
+ * We read the entries without HDB_F_DECRYPT and so the keys remain
+ * sealed in the master key.  The whole walk is done under a single
+ * read lock to give a consistent copy.  We hold only one entry at a
+ * time and write through a fixed buffer so our memory use does not
+ * depend on the size of the realm.  The records are written at the
+ * current offset of fd and the number of records is returned.
+ */
+
+#define EXPORT_BUFSIZ	(256 * 1024)
+
+struct export_buf {
+	int		 fd;
+	size_t		 len;
+	unsigned char	 buf[EXPORT_BUFSIZ];
+};
+
+static int
+write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t	n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return errno;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+export_flush(struct export_buf *eb)
+{
+	int	ret;
+
+	ret = write_all(eb->fd, eb->buf, eb->len);
+	eb->len = 0;
+	return ret;
+}
+
+static int
+export_record(struct export_buf *eb, const void *data, size_t len)
+{
+	unsigned char	*p;
+	int		 ret;
+
+	if (len > 0xffffffffUL)
+		return EOVERFLOW;
+
+	if (eb->len + 4 + len > sizeof(eb->buf)) {
+		ret = export_flush(eb);
+		if (ret)
+			return ret;
+	}
+
+	p = eb->buf + eb->len;
+	p[0] = (len >> 24) & 0xff;
+	p[1] = (len >> 16) & 0xff;
+	p[2] = (len >>  8) & 0xff;
+	p[3] = len & 0xff;
+	eb->len += 4;
+
+	if (len > sizeof(eb->buf) - eb->len) {
+		ret = export_flush(eb);
+		if (ret)
+			return ret;
+		return write_all(eb->fd, data, len);
+	}
+
+	memcpy(eb->buf + eb->len, data, len);
+	eb->len += len;
+	return 0;
+}
+
+long
+export_kdb(krb5_context ctx, kadm5_handle hndl, int fd)
+{
+	HDB			*db = NULL;
+	hdb_entry_ex		 ent;
+	krb5_data		 value;
+	struct export_buf	*eb = NULL;
+	krb5_error_code		 ret;
+	long			 count = 0;
+	int			 have_ent = 0;
+	int			 opened = 0;
+	int			 locked = 0;
+	char			 croakstr[2048] = "";
+
+	memset(&ent, 0, sizeof(ent));
+
+	eb = malloc(sizeof(*eb));
+	if (!eb)
+		BAIL(ENOMEM, "export_kdb: malloc failed");
+	eb->fd = fd;
+	eb->len = 0;
+
+	db = _kadm5_s_get_db(hndl);
+	K5BAIL(db->hdb_open(ctx, db, O_RDONLY, 0));
+	opened = 1;
+	K5BAIL(db->hdb_lock(ctx, db, HDB_RLOCK));
+	locked = 1;
+
+	ret = db->hdb_firstkey(ctx, db, 0, &ent);
+	while (ret == 0) {
+		have_ent = 1;
+		K5BAIL(hdb_entry2value(ctx, &ent.entry, &value));
+		ret = export_record(eb, value.data, value.length);
+		krb5_data_free(&value);
+		BAIL(ret, strerror(ret));
+		hdb_free_entry(ctx, &ent);
+		have_ent = 0;
+		count++;
+
+		ret = db->hdb_nextkey(ctx, db, 0, &ent);
+	}
+
+	if (ret == HDB_ERR_NOENTRY)
+		ret = 0;
+	K5BAIL(ret);
+
+	BAIL(export_flush(eb), strerror(ret));
+
+done:
+	if (have_ent)
+		hdb_free_entry(ctx, &ent);
+	if (locked)
+		db->hdb_unlock(ctx, db);
+	if (opened)
+		db->hdb_close(ctx, db);
+	free(eb);
+
+	if (ret)
+		croak("%s", croakstr);
+
+	return count;
+}
+
+/*
+ * import_kdb() is the inverse of export_kdb().  It maps the snapshot at
+ * path and stores each of the records in the length bytes at offset in
+ * the KDB, replacing any existing entry of the same name.  The entries
+ * are stored as they are and so their keys must be sealed in our master
+ * key, i.e. the snapshot must come from a KDC which shares it.  We take
+ * the write lock once for the whole load and turn off the synchronous
+ * writes of the backend so that the DB is only flushed when we close it
+ * rather than after every entry.  The number of entries is returned.
+ */
+
+long
+import_kdb(krb5_context ctx, kadm5_handle hndl, char *path, long offset,
+	   long length)
+{
+	HDB			*db = NULL;
+	hdb_entry_ex		 ent;
+	krb5_data		 value;
+	struct stat		 sb;
+	unsigned char		*map = MAP_FAILED;
+	const unsigned char	*p;
+	const unsigned char	*end;
+	krb5_error_code		 ret;
+	size_t			 len;
+	long			 count = 0;
+	int			 fd = -1;
+	int			 have_ent = 0;
+	int			 opened = 0;
+	int			 locked = 0;
+	char			 croakstr[2048] = "";
+
+	memset(&ent, 0, sizeof(ent));
+	memset(&sb, 0, sizeof(sb));
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		BAIL(errno, strerror(ret));
+	if (fstat(fd, &sb) == -1)
+		BAIL(errno, strerror(ret));
+
+	if (offset < 0 || length < 0 || offset > sb.st_size ||
+	    length > sb.st_size - offset)
+		BAIL(EINVAL, "section is outside of the snapshot");
+
+	if (sb.st_size > 0) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			BAIL(errno, strerror(ret));
+		madvise(map, sb.st_size, MADV_SEQUENTIAL);
+	}
+
+	db = _kadm5_s_get_db(hndl);
+	K5BAIL(db->hdb_open(ctx, db, O_RDWR, 0));
+	opened = 1;
+	K5BAIL(db->hdb_lock(ctx, db, HDB_WLOCK));
+	locked = 1;
+	K5BAIL(hdb_set_sync(ctx, db, 0));
+
+	p = map + offset;
+	end = p + length;
+	while (p < end) {
+		if (end - p < 4)
+			BAIL(EINVAL, "truncated record in snapshot");
+
+		len = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) |
+		    ((size_t)p[2] << 8) | (size_t)p[3];
+		p += 4;
+
+		if ((size_t)(end - p) < len)
+			BAIL(EINVAL, "truncated record in snapshot");
+
+		value.data = (void *)p;
+		value.length = len;
+		K5BAIL(hdb_value2entry(ctx, &value, &ent.entry));
+		have_ent = 1;
+		K5BAIL(db->hdb_store(ctx, db, HDB_F_REPLACE, &ent));
+		hdb_free_entry(ctx, &ent);
+		have_ent = 0;
+
+		p += len;
+		count++;
+	}
+
+done:
+	if (have_ent)
+		hdb_free_entry(ctx, &ent);
+	if (locked) {
+		hdb_set_sync(ctx, db, 1);
+		db->hdb_unlock(ctx, db);
+	}
+	if (opened)
+		db->hdb_close(ctx, db);
+	if (map != MAP_FAILED)
+		munmap(map, sb.st_size);
+	if (fd != -1)
+		close(fd);
+
+	if (ret)
+		croak("%s", croakstr);
+
+	return count;
+}
 #else
 krb5_error_code
 init_kdb(krb5_context ctx, kadm5_handle hndl)
@@ -1529,4 +2873,26 @@ init_kdb(krb5_context ctx, kadm5_handle hndl)
 
 	croak("init_kdb is not implemented for MIT Kerberos");
 }
+
+const char *
+kadm5_log_file(krb5_context ctx, kadm5_handle hndl)
+{
+
+	return NULL;
+}
+
+long
+export_kdb(krb5_context ctx, kadm5_handle hndl, int fd)
+{
+
+	croak("export_kdb is not implemented for MIT Kerberos");
+}
+
+long
+import_kdb(krb5_context ctx, kadm5_handle hndl, char *path, long offset,
+	   long length)
+{
+
+	croak("import_kdb is not implemented for MIT Kerberos");
+}
 #endif
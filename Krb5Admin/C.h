@@ -104,13 +104,20 @@ char	 *krb5_randpass(krb5_context, kadm5_handle, char *, int,
 			krb5_key_salt_tuple *);
 void	  krb5_randkey(krb5_context, kadm5_handle, char *);
 char	**krb5_get_kdcs(krb5_context, char *);
+void	  krb5_kdc_cache_config(char *, int);
 char	 *krb5_get_realm(krb5_context);
 char	**krb5_list_princs(krb5_context, kadm5_handle, char *);
 char	**krb5_list_pols(krb5_context, kadm5_handle, char *);
 
 void	  init_store_creds(krb5_context, char *, krb5_creds *);
+ccache_state	  read_ccache_tgt(krb5_context, char *);
+int		  store_ccache(krb5_context, char *, krb5_creds *, int, int);
 
 krb5_error_code		 init_kdb(krb5_context, kadm5_handle);
+const char		*kadm5_log_file(krb5_context, kadm5_handle);
+long			 export_kdb(krb5_context, kadm5_handle, int);
+long			 import_kdb(krb5_context, kadm5_handle, char *, long,
+				    long);
 krb5_creds		*mint_ticket(krb5_context, kadm5_handle, char *, int,
 				     int);
 krb5_keyblock		 get_kte(krb5_context, char *, char *);
@@ -119,6 +126,11 @@ kadm5_principal_ent_rec	 krb5_query_princ(krb5_context, kadm5_handle, char *);
 kadm5_handle		 krb5_get_kadm5_hndl(krb5_context, char *);
 krb5_error_code		 kadm5_destroy(kadm5_handle);
 
+kadm5_handle		 kadm5_pool_get(char *);
+krb5_error_code		 kadm5_pool_release(kadm5_handle);
+void			 kadm5_pool_invalidate(kadm5_handle);
+kadm5_pool_stats	 kadm5_pool_get_stats(void);
+
 void	 krb5_modprinc(krb5_context, kadm5_handle, kadm5_principal_ent_rec,
 		       long);
 char	*krb5_createprinc(krb5_context, kadm5_handle,
@@ -131,6 +143,9 @@ krb5_error_code	krb5_init_context(krb5_context *OUTPUT);
 void		krb5_free_context(krb5_context);
 void		my_free_ctx(krb5_context *);
 krb5_error_code	krb5_parse_name(krb5_context, const char *, krb5_principal *);
+parsed_princ	parse_name(krb5_context, char *);
+canon_princ	parse_name_canon(krb5_context, char *);
+char	       *unparse_name(krb5_context, int ncomps, char **comps);
 krb5_error_code krb5_string_to_key(krb5_context, krb5_enctype, const char *,
 				   krb5_principal, krb5_keyblock *OUTPUT);
 
@@ -8,6 +8,10 @@ use Krb5Admin::C;
 use strict;
 use warnings;
 
+use constant {
+	BATCH_MAX_CALLS	=> 1000,
+};
+
 our @KHARON_RW_SC_EXPORT = qw/	bind_host
 				bootstrap_host_key
 				change
@@ -15,24 +19,29 @@ our @KHARON_RW_SC_EXPORT = qw/	bind_host
 				create
 				create_bootstrap_id
 				create_host
+				create_hosts
 				create_user
 				disable
 				enable
 				generate_ecdh_key1
+				insert_host_label
 				insert_hostmap
 				insert_ticket
 				master
 				modify_host
 				remove 
 				remove_host
+				remove_host_label
 				remove_hostmap
 				remove_ticket
 				reset_passwd
+				share_ticket
 			     /;
 
 our @KHARON_RO_SC_EXPORT = qw/	query	/;
 
-our @KHARON_RO_AC_EXPORT = qw/	fetch
+our @KHARON_RO_AC_EXPORT = qw/	batch
+				fetch
 				fetch_tickets
 				list
 				listpols
@@ -125,6 +134,23 @@ sub regenkeys {
 	};
 }
 
+#
+# pipeline() runs a list of read-only calls, each [METHOD, ARGS...], and
+# returns their results in order.  The calls are sent to batch() in
+# groups of BATCH_MAX_CALLS and so cost one round trip per group rather
+# than one per call.
+
+sub pipeline {
+	my ($self, @calls) = @_;
+	my @ret;
+
+	while (@calls) {
+		push(@ret, $self->batch(splice(@calls, 0, BATCH_MAX_CALLS)));
+	}
+
+	return @ret;
+}
+
 1;
 
 __END__
@@ -277,6 +303,26 @@ value will be equivalent to:
 The function is provided mostly for Krb5Admin::Client's use to reduce the
 number of network round trips.
 
+=item $kmdb->batch([METHOD, ARGS...], ...)
+
+Will run each of the supplied calls and return a list containing one
+hash reference per call, in order.  Each will contain either the key
+``result'' holding what the method returned or the key ``error''
+holding the exception that it threw.  Methods which return a list
+will have their result returned as an array reference.  Each call is
+subject to its own ACL check and only the read-only methods may be
+batched.  No more than 1000 calls may be passed in a single batch.
+
+=item $kmdb->pipeline([METHOD, ARGS...], ...)
+
+Is the same as batch() except that it accepts any number of calls and
+splits them into as many batches as are required.  This is provided
+mostly for Krb5Admin::Client's use to reduce the number of network
+round trips, e.g.:
+
+	my @princs = map { $_->{result} }
+	    $kmdb->pipeline(map { [query => $_] } @names);
+
 =item $kmdb->query(PRINCIPAL)
 
 Will return a hash reference containing various attributes about
@@ -302,4 +348,70 @@ Will set the -allow_tix flag from PRINCIPAL.
 
 Will remove PRINCIPAL.
 
+=item $kmdb->create_hosts([{name => NAME, realm => REALM, ...}, ...])
+
+Will create each of the hosts in a single transaction.  Each host is a
+hash reference containing its name, realm and, optionally, ip_addr,
+bootbinding and label, an array reference of labels.  Hosts which are
+malformed or which already exist are skipped.  An array reference is
+returned containing an element per host which is undef if the host was
+created or the error if it was not.
+
+=item $kmdb->remove_host(HOST[, HOST, ...])
+
+Will remove each of the HOSTs and their labels in a single transaction.
+Hosts which do not exist, are in the hostmap or have tickets prestashed
+on them are left alone.  An array reference is returned containing an
+element per host which is undef if the host was removed or the error if
+it was not.
+
+=item $kmdb->query_host(FIELD => VALUE, ...)
+
+Will return the hosts which match the query.  If the query contains
+``label'', which may be a single label or an array reference of labels,
+then a hash reference mapping the name of each matching host to a hash
+reference of its realm, ip_addr, bootbinding and label is returned.
+By default a host must have all of the labels to match; if ``match''
+is set to ``any'' then a host matches if it has any of them.  The other
+fields must match exactly.
+
+=item $kmdb->insert_host_label(LABEL, HOST[, HOST, ...])
+
+Will add LABEL to each of the HOSTs.  Hosts which already have the
+label are left unchanged.
+
+=item $kmdb->remove_host_label(LABEL, HOST[, HOST, ...])
+
+Will remove LABEL from each of the HOSTs.
+
+=item $kmdb->insert_ticket(PRINCIPAL, HOST[, HOST, ...])
+
+Will prestash PRINCIPAL's tickets on each HOST.  A HOST of the form
+label:LABEL prestashes them on each host which has the label LABEL
+and on each host onto which such a host maps.  The membership of the
+label is resolved each time that the tickets are fetched, but at least
+one host must carry LABEL when the tickets are prestashed.  A ticket on
+a label counts against the per-host limit of each host which carries
+the label.  Label targets may be queried and removed with query_ticket()
+and remove_ticket() in the same way as hosts.
+
+=item $kmdb->share_ticket(PRINCIPAL, SHARE)
+
+Will allow, if SHARE is true, or disallow the tickets prestashed for
+PRINCIPAL on a logical host to be shared between the hosts that the
+logical host maps onto.  Hosts which fetch their tickets within a few
+minutes of each other will then receive the same credential.
+
+=item $kmdb->fetch_tickets(REALM[, HOST[, STATE]])
+
+Will return a hash reference mapping each of the principals that are
+prestashed on HOST in REALM to a freshly minted ticket.  HOST defaults
+to the host of the client's principal.  If STATE, a hash reference
+mapping each principal that the client already has a ticket for to the
+ticket's endtime, is supplied then a hash reference is returned that
+contains ``tickets'', which maps only the principals whose tickets are
+missing or about to expire to new tickets, and ``remove'', an array
+reference of the principals in STATE which are no longer prestashed on
+HOST.
+
 =back
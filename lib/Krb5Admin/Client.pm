@@ -12,9 +12,152 @@ use Kharon::Engine::Client::Knc;
 
 use Krb5Admin::C;
 
+use IO::File;
+use IO::Select;
+use IO::Socket::INET;
+use Socket qw/SOL_SOCKET SO_ERROR/;
+use Time::HiRes qw/time/;
+
 use strict;
 use warnings;
 
+use constant {
+	CONNECT_STAGGER		=> 0.25,
+	CONNECT_TIMEOUT		=> 10,
+	FAILURE_CACHE		=> "/var/tmp/krb5_admin_kdc_failures.$<",
+	FAILURE_CACHE_TTL	=> 300,
+	KDC_CACHE		=> "/var/tmp/krb5_admin_kdcs.$<",
+	KDC_CACHE_TTL		=> 300,
+};
+
+#
+# The failure cache is a file of ``server time'' lines recording the
+# KDCs to which we recently failed to connect.  It is advisory and so
+# errors reading or writing it are ignored.  As it lives in /var/tmp,
+# we ignore it unless it belongs to us and only we can write to it, as
+# we do with the KDC cache, so that other users cannot reorder our KDCs.
+
+sub read_failure_cache {
+	my ($file) = @_;
+	my %failed;
+
+	my $fh = IO::File->new($file, 'r');
+	return %failed if !defined($fh);
+
+	my @st = stat($fh);
+	return %failed if !@st || $st[4] != $< || ($st[2] & 022);
+
+	while (<$fh>) {
+		my ($server, $when) = split;
+
+		next if !defined($when) || $when !~ /^\d+$/;
+		next if $when + FAILURE_CACHE_TTL < time();
+
+		$failed{$server} = $when;
+	}
+
+	return %failed;
+}
+
+sub write_failure_cache {
+	my ($file, %failed) = @_;
+	my $tmp = "$file.$$";
+
+	my $fh = IO::File->new($tmp, O_CREAT|O_EXCL|O_WRONLY, 0600);
+	return if !defined($fh);
+
+	for my $server (keys %failed) {
+		print $fh "$server $failed{$server}\n";
+	}
+
+	if (!close($fh) || !rename($tmp, $file)) {
+		unlink($tmp);
+	}
+}
+
+#
+# race_servers() returns @servers reordered so that the first server to
+# accept a TCP connexion is first.  We start a non-blocking connect(2)
+# to each server in turn, starting the next one when the previous one
+# fails or after CONNECT_STAGGER seconds, and stop as soon as one
+# succeeds.  Servers in the failure cache are tried last and servers
+# which failed this time are moved to the end.  The failure cache is only
+# rewritten if it has changed, or to refresh a failure that is more than
+# half way to expiring.
+
+sub race_servers {
+	my ($port, $cache, @servers) = @_;
+	my %failed = read_failure_cache($cache);
+	my $sel = IO::Select->new();
+	my %pending;
+	my @won;
+	my @lost;
+
+	my @order = ((grep { !exists($failed{$_}) } @servers),
+		     (grep {  exists($failed{$_}) } @servers));
+	my @todo = @order;
+
+	my $deadline = time() + CONNECT_TIMEOUT;
+	my $next = 0;
+
+	while (!@won && (@todo || $sel->count()) && time() < $deadline) {
+		if (@todo && time() >= $next) {
+			my $server = shift(@todo);
+			my $sock = IO::Socket::INET->new(PeerAddr => $server,
+			    PeerPort => $port, Proto => 'tcp', Blocking => 0);
+
+			if (!defined($sock)) {
+				push(@lost, $server);
+				$next = 0;
+				next;
+			}
+
+			$pending{fileno($sock)} = $server;
+			$sel->add($sock);
+			$next = time() + CONNECT_STAGGER;
+		}
+
+		my $wait = $deadline - time();
+		$wait = $next - time()	if @todo && $next - time() < $wait;
+		$wait = 0		if $wait < 0;
+
+		for my $sock ($sel->can_write($wait)) {
+			my $server = delete($pending{fileno($sock)});
+			my $err = getsockopt($sock, SOL_SOCKET, SO_ERROR);
+
+			$sel->remove($sock);
+			close($sock);
+
+			if (!@won && defined($err) && unpack('i', $err) == 0) {
+				push(@won, $server);
+				next;
+			}
+
+			push(@lost, $server)	if !defined($err) ||
+						   unpack('i', $err) != 0;
+			$next = 0;
+		}
+	}
+
+	for my $sock ($sel->handles()) {
+		close($sock);
+	}
+
+	my $now = int(time());
+	my $changed = grep { exists($failed{$_}) } @won;
+	$changed += grep {
+		!exists($failed{$_}) ||
+		$failed{$_} < $now - FAILURE_CACHE_TTL / 2
+	} @lost;
+
+	delete @failed{@won};
+	$failed{$_} = $now	for @lost;
+	write_failure_cache($cache, %failed)	if $changed;
+
+	my %seen = map { $_ => 1 } (@won, @lost);
+	return (@won, (grep { !$seen{$_} } @order), @lost);
+}
+
 sub new {
 	my ($proto, $princ, $opts, @servers) = @_;
 	my $class = ref($proto) || $proto;
@@ -34,6 +177,11 @@ sub new {
 	$realm = $opts->{realm} if exists($opts->{realm});
 
 	if (scalar(@servers) < 1) {
+		my $kdc_cache = KDC_CACHE;
+		$kdc_cache = $opts->{kdc_cache} if exists($opts->{kdc_cache});
+
+		Krb5Admin::C::krb5_kdc_cache_config($kdc_cache, KDC_CACHE_TTL);
+
 		my $kdcs = Krb5Admin::C::krb5_get_kdcs($ctx, $realm);
 		@servers = @$kdcs;
 	}
@@ -55,7 +203,27 @@ sub new {
 		Krb5Admin::C::kinit_kt($ctx, $princ, undef, undef);
 	}
 
-	$pec->SetServerDefaults({KncService=>'krb5_admin', PeerPort=>$port});
+	#
+	# Rather than letting a dead or slow first KDC cost us a full
+	# connect timeout, we race them and have Kharon try them in the
+	# order in which they answered.  Kharon still authenticates and
+	# fails over to the next server as usual.  We need a numeric port
+	# for this and if the service name does not resolve, we skip it.
+
+	my $portnum = $port;
+	$portnum = getservbyname($port, 'tcp')	if $port !~ /^\d+$/;
+
+	if (!exists($opts->{stdin_protocol}) && !$opts->{serial_connect} &&
+	    defined($portnum) && @servers > 1) {
+		my $cache = FAILURE_CACHE;
+		$cache = $opts->{failure_cache}
+		    if exists($opts->{failure_cache});
+
+		@servers = race_servers($portnum, $cache, @servers);
+	}
+
+	$pec->SetServerDefaults({KncService => 'krb5_admin',
+	    PeerPort => $port});
 	if (!$pec->Connect(@servers)) {
 		die [500, qq{Can't connect to any servers}];
 	}
@@ -107,6 +275,28 @@ realm is assumed.
 the port on the KDC to which to connect.  This may be specified as either
 an integer or as a string which is looked up in the services map.
 
+=item serial_connect
+
+if set to true, the KDCs will be tried strictly in order.  By default,
+connexions are started to the KDCs in a staggered race and the first
+KDCs are then tried in the order in which they answered, so that the
+first to answer is tried first.
+
+=item failure_cache
+
+the file in which KDCs that recently failed to answer are recorded so
+that they are tried last.  It is ignored unless it belongs to the user
+and cannot be written by others.  Defaults to
+/var/tmp/krb5_admin_kdc_failures.UID.
+
+=item kdc_cache
+
+the file in which the discovered KDCs are cached for five minutes so
+that short-lived processes need not look them up in DNS each time.
+It is ignored unless it belongs to the user and cannot be written by
+others.  Defaults to /var/tmp/krb5_admin_kdcs.UID.  If set to undef, the
+KDCs are only cached in memory.
+
 =item stdin_protocol
 
 this is a debugging option.  If set to true, Krb5Admin::Client will
@@ -6,13 +6,14 @@ package Krb5Admin::KerberosDB;
 use base qw/Krb5Admin/;
 
 use DBI;
+use Fcntl qw/SEEK_END/;
 use Sys::Hostname;
 use Sys::Syslog;
 
 use Krb5Admin::Utils qw/reverse_the host_list/;
 use Krb5Admin::C;
-use Kharon::Entitlement::ACLFile;
-use Kharon::Entitlement::Equals;
+use Krb5Admin::Policy;
+use Krb5Admin::Snapshot;
 
 use Kharon::dbutils qw/sql_command generic_query/;
 
@@ -41,6 +42,14 @@ use constant {
 	ACL_FILE		=> '/etc/krb5/krb5_admin.acl',
 	SQL_DB_FILE		=> '/var/kerberos/krb5_admin.db',
 	MAX_TIX_PER_HOST	=> 1024,
+	PRESTASH_LIFETIME	=> 7 * 3600 * 24,
+	PRESTASH_RENEW		=> 2 * 3600 * 24,
+	TICKET_SHARE		=> 300,
+	TICKET_CACHE_MAX	=> 10000,
+	SQL_MAX_BINDV		=> 999,
+	QUERY_CACHE_MAX		=> 4096,
+	QUERY_CACHE_TTL		=> 60,
+	IMPORT_BATCH		=> 10000,
 };
 
 our %flag_map = (
@@ -72,7 +81,7 @@ sub require_princ {
 	my ($ctx, $usage, $argnum, $princ) = @_;
 
 	eval {
-		Krb5Admin::C::krb5_parse_name($ctx, $princ);
+		Krb5Admin::C::parse_name($ctx, $princ);
 	};
 
 	if ($@) {
@@ -83,12 +92,10 @@ sub require_princ {
 
 sub require_fqprinc {
 	my ($ctx, $usage, $argnum, $princ) = @_;
-	my @p;
 	my $tmp;
 
 	eval {
-		@p = Krb5Admin::C::krb5_parse_name($ctx, $princ);
-		$tmp = unparse_princ(\@p);
+		($tmp) = Krb5Admin::C::parse_name_canon($ctx, $princ);
 	};
 
 	if ($@) {
@@ -111,12 +118,113 @@ sub require_hashref {
 	    if ref($arg) ne 'HASH';
 }
 
-# XXXrcd: maybe we should perform a little validation later.
-# XXXrcd: also lame because it is code duplication.
-sub unparse_princ {
-	my ($realm, @comps) = @{$_[0]};
+#
+# sql_cached() is used in place of sql_command() for statements that we
+# run on every request or once per row.  The statement handle is kept in
+# DBI's per-connexion cache which is keyed on the statement text and so
+# we only pay for the prepare once for the lifetime of $dbh.  If the cached
+# handle is still active, DBI will hand us a fresh one.  As many of our
+# modifications span a number of statements, an error rolls back the
+# transaction so that a half finished change is never committed later.
+#
+# sql_uncached() is the same but prepares the statement afresh each time.
+# It is used for statements with an IN list whose text depends on the
+# number of values, as each length would otherwise leave another handle
+# in the cache for the lifetime of $dbh.
+#
+# DBD::SQLite binds our values as TEXT and SQLite orders all INTEGERs
+# before all TEXT, so counts must not be compared with bound values.
+# We put such integers into the statement text instead.
+
+sub sql_execute {
+	my ($dbh, $cached, $stmt, @bindv) = @_;
+	my $sth;
+
+	eval {
+		if ($cached) {
+			$sth = $dbh->prepare_cached($stmt, undef, 3);
+		} else {
+			$sth = $dbh->prepare($stmt);
+		}
+		$sth->execute(@bindv);
+	};
+
+	if ($@) {
+		my $err = defined($dbh->errstr) ? $dbh->errstr : $@;
+
+		$dbh->rollback()	if !$dbh->{AutoCommit};
+		die [510, "SQL ERROR: " . $err];
+	}
+
+	return $sth;
+}
+
+sub sql_cached {
+	my ($dbh, $stmt, @bindv) = @_;
+
+	return sql_execute($dbh, 1, $stmt, @bindv);
+}
+
+sub sql_uncached {
+	my ($dbh, $stmt, @bindv) = @_;
+
+	return sql_execute($dbh, 0, $stmt, @bindv);
+}
+
+#
+# sql_chunks() splits a list of bind values into chunks which will
+# fit into a single statement given that each row uses $width values.
+# SQLite limits us to SQL_MAX_BINDV bind values per statement.
+
+sub sql_chunks {
+	my ($width, $reserved, @vals) = @_;
+	my $rows = int((SQL_MAX_BINDV - $reserved) / $width);
+	my @ret;
+
+	while (@vals) {
+		push(@ret, [splice(@vals, 0, $rows * $width)]);
+	}
+
+	return @ret;
+}
+
+#
+# sql_bulk_insert() inserts @rows (array refs of values for @$cols) into
+# $table using multi-row INSERTs.  All but the last chunk share the same
+# statement text and so will share a cached statement handle, the last
+# is prepared afresh.
+# sql_bulk_insert_ignore() is the same but silently skips the rows which
+# are already present.
+
+sub sql_bulk_rows {
+	my ($dbh, $verb, $table, $cols, @rows) = @_;
+	my $width = scalar(@$cols);
+	my $row = '(' . join(',', map { '?' } @$cols) . ')';
+
+	my $full = int(SQL_MAX_BINDV / $width) * $width;
+
+	for my $chunk (sql_chunks($width, 0, map { @$_ } @rows)) {
+		my $stmt = "$verb INTO $table (" . join(', ', @$cols) .
+		    ") VALUES " . join(',', ($row) x (@$chunk / $width));
+
+		if (@$chunk == $full) {
+			sql_cached($dbh, $stmt, @$chunk);
+		} else {
+			sql_uncached($dbh, $stmt, @$chunk);
+		}
+	}
+}
+
+sub sql_bulk_insert {
+	my ($dbh, $table, $cols, @rows) = @_;
+
+	sql_bulk_rows($dbh, 'INSERT', $table, $cols, @rows);
+}
+
+sub sql_bulk_insert_ignore {
+	my ($dbh, $table, $cols, @rows) = @_;
 
-	return join('/', @comps) . '@' . $realm;
+	sql_bulk_rows($dbh, 'INSERT OR IGNORE', $table, $cols, @rows);
 }
 
 #
@@ -127,7 +235,7 @@ sub unparse_princ {
 sub check_acl {
 	my ($self, $verb, @predicate) = @_;
 	my $subject = $self->{client};
-	my $acl = $self->{acl};
+	my $policy = $self->{policy};
 	my $dbh = $self->{dbh};
 	my $denied;
 
@@ -151,7 +259,7 @@ sub check_acl {
 	# First we provide an Kharon file based entitlement system which
 	# precedes all of the special processing...
 
-	return if $acl->check($verb);
+	return if $policy->check($subject, $verb);
 
 	#
 	# We also need creds.  This is mainly for my use running this
@@ -167,7 +275,7 @@ sub check_acl {
 	# framework.
 
 	my $ctx = $self->{ctx};
-	my @sprinc = Krb5Admin::C::krb5_parse_name($ctx, $subject);
+	my @sprinc = Krb5Admin::C::parse_name($ctx, $subject);
 
 	if ($verb eq 'fetch_tickets') {
 		die [502, "Permission denied"]	if $sprinc[1] ne 'host';
@@ -176,17 +284,23 @@ sub check_acl {
 		# Now, we must also check to ensure that the client is
 		# in the correct realm for the host that we have in our DB.
 
-		my $host = $self->query_host(name=>$predicate[0]);
-		if (!defined($host) || $host->{realm} ne $sprinc[0]) {
+		my $sth = sql_cached($dbh, "SELECT realm FROM hosts " .
+		    "WHERE name = ?", $predicate[0]);
+		my $host = $sth->fetchrow_arrayref();
+		$sth->finish();
+
+		if (!defined($host) || $host->[0] ne $sprinc[0]) {
 			die [502, "Permission denied"];
 		}
 		# The request is authorised.
 		return;
 	}
 
+	my $up_pprinc;
 	my @pprinc;
 	if (defined($predicate[0])) {
-		@pprinc = Krb5Admin::C::krb5_parse_name($ctx, $predicate[0]);
+		($up_pprinc, @pprinc) = Krb5Admin::C::parse_name_canon($ctx,
+		    $predicate[0]);
 	}
 
 	if ($verb eq 'bootstrap_host_key') {
@@ -201,10 +315,11 @@ sub check_acl {
 			SELECT COUNT(*) FROM hosts
 			WHERE realm = ? AND name = ? AND bootbinding = ?
 		};
-		my $sth = sql_command($dbh, $stmt, $realm, $host,
-		    $subject);
+		my $sth = sql_cached($dbh, $stmt, $realm, $host, $subject);
+		my $count = $sth->fetchrow_arrayref()->[0];
+		$sth->finish();
 
-		if ($sth->fetchrow_arrayref()->[0] != 1) {
+		if ($count != 1) {
 			die [502, "Permission denied: you are not bound to " .
 			    "$host"];
 		}
@@ -230,13 +345,15 @@ sub check_acl {
 	if ($pprinc[1] eq 'host') {
 
 		#
-		# If Krb5Admin::Utils::reverse_the is defined then we
-		# will have $self->{hostname} and we'll use it to validate
-		# that the request is coming from a properly mapped host.
-		# Otherwise, we ignore it.
+		# If Krb5Admin::Utils::reverse_the can map the client's
+		# address to a name then we use it to validate that the
+		# request is coming from a properly mapped host.  Otherwise,
+		# we ignore it.  This is the only place that we need the
+		# name and so it is only looked up here.
 
-		my $host_ok = defined($self->{hostname}) ?
-		    grep { $_ eq $pprinc[2] } host_list($self->{hostname}) : 1;
+		my $hostname = $self->client_hostname();
+		my $host_ok = defined($hostname) ?
+		    grep { $_ eq $pprinc[2] } host_list($hostname) : 1;
 
 		#
 		# We first allow hosts to change their own keys:
@@ -248,17 +365,13 @@ sub check_acl {
 		}
 
 		#
-		# We check to see if we are doing an xrealm bootstrap, we
-		# do this by generating a list of principals that we will
-		# accept first and then seeing if our client is one of them.
-
-		my @xbs = ();
-		if (@sprinc == 3 && $sprinc[1] eq 'host' &&
-		    ref($self->{xrealm_bootstrap}) eq 'HASH' &&
-		    ref($self->{xrealm_bootstrap}->{$sprinc[0]}) eq 'ARRAY') {
-			@xbs = @{$self->{xrealm_bootstrap}->{$sprinc[0]}};
-			@xbs = map { unparse_princ([$_, @sprinc[1,2]]) } @xbs;
-		}
+		# We check to see if we are doing an xrealm bootstrap, i.e.
+		# host/foo@A asking for host/foo@B where the xrealm_bootstrap
+		# table allows A to bootstrap B.
+
+		return if $host_ok == 1 && @sprinc == 3 &&
+		    $sprinc[1] eq 'host' && $sprinc[2] eq $pprinc[2] &&
+		    $policy->xrealm_bootstrap($sprinc[0], $pprinc[0]);
 
 		#
 		# Windows principals are case insensitive, so we canonicalize
@@ -266,24 +379,18 @@ sub check_acl {
 		# and expect the lookup keys in win_xrealm_bootstrap to be
 		# likewise lower case.
 
-		my $up_sprinc =
-		    unparse_princ([$sprinc[0],
-				   map {lc $_} @sprinc[1..$#sprinc]]);
-		my $win_xrealm_bootstrap = $self->{win_xrealm_bootstrap};
-		if (ref($win_xrealm_bootstrap) eq 'HASH' &&
-		    ref($win_xrealm_bootstrap->{$up_sprinc}) eq 'ARRAY') {
-			push(@xbs, @{$win_xrealm_bootstrap->{$up_sprinc}});
-		}
+		my $up_sprinc = Krb5Admin::C::unparse_name($ctx,
+		    [$sprinc[0], map { lc($_) } @sprinc[1..$#sprinc]]);
 
-		my $up_pprinc = unparse_princ(\@pprinc);
-		return if $host_ok == 1 && grep {$_ eq $up_pprinc} @xbs;
+		return if $host_ok == 1 &&
+		    $policy->win_xrealm_bootstrap($up_sprinc, $up_pprinc);
 
 		$denied = "not an admin user";
 		if (!$host_ok) {
 			$denied  = "host does not match IP address";
-			$denied .= " [" . $self->{hostname} . " not in " .
+			$denied .= " [" . $hostname . " not in " .
 
-			$denied .= join(',', host_list($self->{hostname}));
+			$denied .= join(',', host_list($hostname));
 			$denied .= "]";
 		}
 	} else {
@@ -330,10 +437,14 @@ sub new {
 	$dbh->do("PRAGMA journal_mode = WAL");
 	$dbh->{AutoCommit} = 0;
 
-	my $subacls = Kharon::Entitlement::Equals->new();
-	my $acl = Kharon::Entitlement::ACLFile->new(filename => $acl_file,
-	    subobject => $subacls);
-	$acl->set_creds($args{client});
+	#
+	# The generation of the KDB is read through a second handle which
+	# is never in a transaction so that we always see the latest one,
+	# see query_cache().
+
+	my $gen_dbh = DBI->connect("dbi:SQLite:$sqlite", "", "",
+	    {RaiseError => 1, PrintError => 0, AutoCommit => 1});
+	die "Could not open database " . DBI::errstr if !defined($gen_dbh);
 
 	my $ctx = $self->{ctx};
 
@@ -341,11 +452,12 @@ sub new {
 	$self->{local}	  = $args{local};
 	$self->{client}	  = $args{client};
 	$self->{addr}	  = $args{addr};
-	$self->{hostname} = reverse_the($args{addr});
 	$self->{ctx}	  = $ctx;
-	$self->{hndl}	  = Krb5Admin::C::krb5_get_kadm5_hndl($ctx, $dbname);
-	$self->{acl}	  = $acl;
+	$self->{dbname}	  = $dbname;
+	$self->{hndl}	  = Krb5Admin::C::kadm5_pool_get($dbname);
+	$self->{acl_file} = $acl_file;
 	$self->{dbh}	  = $dbh;
+	$self->{gen_dbh}  = $gen_dbh;
 
 	$self->{local}	= 0			if !defined($self->{local});
 	$self->{client}	= "LOCAL_MODIFICATION"	if          $self->{local};
@@ -355,6 +467,19 @@ sub new {
 	$self->{xrealm_bootstrap}	= $args{xrealm_bootstrap};
 	$self->{win_xrealm_bootstrap}	= $args{win_xrealm_bootstrap};
 	$self->{prestash_xrealm}	= $args{prestash_xrealm};
+	$self->{rdns_cache}		= $args{rdns_cache};
+	$self->{scheduler}		= $args{scheduler};
+	$self->{prestash_renew}		= $args{prestash_renew};
+	$self->{ticket_share}		= $args{ticket_share};
+
+	$self->{policy} = Krb5Admin::Policy->get(acl_file => $acl_file,
+	    map { $_ => $self->{$_} } qw/xrealm_bootstrap
+	    win_xrealm_bootstrap prestash_xrealm/);
+
+	$self->{prestash_renew} = PRESTASH_RENEW
+	    if !defined($self->{prestash_renew});
+	$self->{ticket_share} = TICKET_SHARE
+	    if !defined($self->{ticket_share});
 
 	if (!defined($self->{allow_fetch})) {
 		$self->{allow_fetch} = 0;
@@ -364,13 +489,102 @@ sub new {
 	bless($self, $class);
 }
 
+#
+# rebind() returns an object for a new connexion which shares the long
+# lived state of $self: the krb5 context, SQLite handle and compiled
+# policy.  Only the keys in @process_state are copied, so everything
+# else that a connexion accumulates, e.g. the client's identity, its
+# hostname or the ECDH secret from generate_ecdh_key1(), starts afresh.
+# The kadm5 handle comes back from the pool.  This saves most of the
+# cost of new().  When the connexion's object is destroyed at the end
+# of the connexion we roll back any open transaction.  Read-only calls
+# leave one open and it would otherwise hold the SQLite write lock and
+# pin the WAL while the process sits idle in accept(2).
+
+our @process_state = qw/acl_file allow_fetch ctx dbh dbname debug gen_dbh
+	local prestash_renew prestash_xrealm rdns_cache scheduler ticket_share
+	win_xrealm_bootstrap xrealm_bootstrap/;
+
+sub rebind {
+	my ($self, %args) = @_;
+	my $dbh = $self->{dbh};
+
+	#
+	# Anything left uncommitted is discarded so that it cannot be
+	# committed on behalf of the next client.
+
+	$dbh->rollback()			if !$dbh->{AutoCommit};
+
+	#
+	# We give our own kadm5 handle back to the pool as the
+	# connexions will each borrow one, health checked and rebuilt
+	# if need be.
+
+	undef($self->{hndl});
+
+	my $conn = bless({ map { $_ => $self->{$_} } @process_state },
+	    ref($self));
+
+	$conn->{connexion} = 1;
+	$conn->{hndl}	   = Krb5Admin::C::kadm5_pool_get($self->{dbname});
+
+	#
+	# The compiled policy is shared by all connexions and only
+	# rebuilt if the ACL file has changed.
+
+	$conn->{policy} = Krb5Admin::Policy->get(acl_file => $self->{acl_file},
+	    map { $_ => $self->{$_} } qw/xrealm_bootstrap
+	    win_xrealm_bootstrap prestash_xrealm/);
+
+	$conn->{client}	= $args{client};
+	$conn->{addr}	= $args{addr};
+
+	$conn->{client}	= "LOCAL_MODIFICATION"	if $self->{local};
+
+	return $conn;
+}
+
+#
+# client_hostname() returns the name of the host from which the client
+# connected.  As most requests never need it, we only look it up the
+# first time that it is asked for.
+
+sub client_hostname {
+	my ($self) = @_;
+
+	if (!exists($self->{hostname})) {
+		$self->{hostname} = reverse_the($self->{addr},
+		    $self->{rdns_cache});
+	}
+
+	return $self->{hostname};
+}
+
 sub DESTROY {
 	my ($self) = @_;
 
+	#
+	# A connexion's object shares the SQLite handle with the rest of
+	# the process and so we only end its transaction.
+
+	if ($self->{connexion}) {
+		my $dbh = $self->{dbh};
+
+		if (defined($dbh) && !$dbh->{AutoCommit}) {
+			eval { $dbh->rollback() };
+		}
+		return;
+	}
+
 	if (defined($self->{dbh})) {
 		$self->{dbh}->disconnect();
 		undef($self->{dbh});
 	}
+
+	if (defined($self->{gen_dbh})) {
+		$self->{gen_dbh}->disconnect();
+		undef($self->{gen_dbh});
+	}
 }
 
 sub init_db {
@@ -386,7 +600,7 @@ sub init_db {
 	#	  addresses or something more like that...
 
 	$dbh->do(qq{
-		CREATE TABLE hosts (
+		CREATE TABLE IF NOT EXISTS hosts (
 			name		VARCHAR NOT NULL PRIMARY KEY,
 			realm		VARCHAR NOT NULL,
 			ip_addr		VARCHAR,
@@ -395,7 +609,7 @@ sub init_db {
 	});
 
 	$dbh->do(qq{
-		CREATE TABLE host_labels (
+		CREATE TABLE IF NOT EXISTS host_labels (
 			host		VARCHAR NOT NULL,
 			label		VARCHAR NOT NULL,
 
@@ -405,7 +619,7 @@ sub init_db {
 	});
 
 	$dbh->do(qq{
-		CREATE TABLE hostmap (
+		CREATE TABLE IF NOT EXISTS hostmap (
 			logical		VARCHAR NOT NULL,
 			physical	VARCHAR NOT NULL,
 
@@ -416,7 +630,7 @@ sub init_db {
 	});
 
 	$dbh->do(qq{
-		CREATE TABLE prestashed (
+		CREATE TABLE IF NOT EXISTS prestashed (
 			principal	VARCHAR NOT NULL,
 			host		VARCHAR NOT NULL,
 
@@ -427,6 +641,251 @@ sub init_db {
 
 	$dbh->{AutoCommit} = 0;
 
+	$self->upgrade_db();
+
+	return undef;
+}
+
+#
+# The tables created above are version 0 of the schema.  Each element
+# of @schema_upgrades takes the schema from version N to N+1 and we keep
+# the current version in SQLite's user_version.  upgrade_db() applies
+# all of the outstanding steps in a single transaction.  It is run from
+# init_db() and so init_db() may be safely re-run on an existing DB to
+# bring it up to date.  New steps must only ever be appended.
+
+our @schema_upgrades = (
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# Store the principal's realm on the prestashed rows so that
+		# realm queries need not use LIKE and then index the lookups
+		# that we do on every fetch_tickets() and check_acl().  The
+		# realm is only indexed as a suffix of host as an index on
+		# realm alone is so unselective that without ANALYZE the
+		# planner may prefer it over the host index.
+
+		$dbh->do("ALTER TABLE prestashed ADD COLUMN realm VARCHAR");
+
+		my $princs = $dbh->selectcol_arrayref(qq{
+			SELECT DISTINCT principal FROM prestashed
+		});
+
+		for my $princ (@$princs) {
+			next if $princ !~ /\@([^@]*)$/;
+
+			sql_cached($dbh, qq{
+				UPDATE prestashed SET realm = ? WHERE principal = ?
+			}, $1, $princ);
+		}
+
+		$dbh->do(qq{
+			CREATE INDEX IF NOT EXISTS prestashed_host
+			ON prestashed(host, realm)
+		});
+		$dbh->do(qq{
+			CREATE INDEX IF NOT EXISTS hostmap_physical
+			ON hostmap(physical)
+		});
+		$dbh->do(qq{
+			CREATE INDEX IF NOT EXISTS hosts_bootbinding
+			ON hosts(bootbinding)
+		});
+	},
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# prestash_expanded is prestashed joined with hostmap and
+		# is maintained by insert_ticket(), remove_ticket(),
+		# insert_hostmap() and remove_hostmap() so that the hosts
+		# fetching their tickets need only look up their name.
+		# Every prestashed row is present with target = configured
+		# and once more per physical host that its host maps onto.
+
+		$dbh->do(qq{
+			CREATE TABLE prestash_expanded (
+				target		VARCHAR NOT NULL,
+				realm		VARCHAR,
+				principal	VARCHAR NOT NULL,
+				configured	VARCHAR NOT NULL,
+
+				PRIMARY KEY (target, principal, configured)
+			)
+		});
+
+		$dbh->do(qq{
+			CREATE INDEX prestash_expanded_configured
+			ON prestash_expanded(configured, principal)
+		});
+
+		$dbh->do(qq{
+			INSERT INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT host, realm, principal, host FROM prestashed
+		});
+
+		$dbh->do(qq{
+			INSERT OR IGNORE INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT hostmap.physical, prestashed.realm,
+			       prestashed.principal, prestashed.host
+			FROM prestashed
+			JOIN hostmap ON prestashed.host = hostmap.logical
+		});
+	},
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# hostmap_closure is the transitive closure of hostmap, so
+		# that logical hosts may map onto other logical hosts.  We
+		# keep the number of distinct paths between each pair so
+		# that removing a mapping can be done incrementally.  We
+		# then rebuild prestash_expanded from the closure.
+
+		$dbh->do(qq{
+			CREATE TABLE hostmap_closure (
+				logical		VARCHAR NOT NULL,
+				physical	VARCHAR NOT NULL,
+				paths		INTEGER NOT NULL,
+
+				PRIMARY KEY (logical, physical)
+			)
+		});
+
+		$dbh->do(qq{
+			CREATE INDEX hostmap_closure_physical
+			ON hostmap_closure(physical)
+		});
+
+		my $edges = $dbh->selectall_arrayref(qq{
+			SELECT logical, physical FROM hostmap
+		});
+
+		for my $edge (@$edges) {
+			if (_hostmap_loops($dbh, @$edge)) {
+				syslog('warning', "hostmap %s -> %s forms a " .
+				    "loop, it will not be expanded", @$edge);
+				next;
+			}
+
+			_hostmap_closure_edge($dbh, @$edge, 1);
+		}
+
+		$dbh->do(qq{
+			DELETE FROM prestash_expanded WHERE target != configured
+		});
+
+		$dbh->do(qq{
+			INSERT OR IGNORE INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT hostmap_closure.physical, prestashed.realm,
+			       prestashed.principal, prestashed.host
+			FROM prestashed
+			JOIN hostmap_closure
+			    ON prestashed.host = hostmap_closure.logical
+		});
+	},
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# prestash_shared lists the principals whose tickets may
+		# be shared by all of the hosts that a logical host maps
+		# onto, see fetch_tickets().
+
+		$dbh->do(qq{
+			CREATE TABLE prestash_shared (
+				principal	VARCHAR NOT NULL PRIMARY KEY
+			)
+		});
+	},
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# The primary key of host_labels only helps us to find the
+		# labels of a host.  query_host() selects hosts by label
+		# and so we index the other direction as well.
+
+		$dbh->do(qq{
+			CREATE INDEX host_labels_label
+			ON host_labels(label, host)
+		});
+	},
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# Tickets may be prestashed on a host label rather than on
+		# a host.  These targets are written label:LABEL and as they
+		# are not hosts, they are kept in prestash_labels rather
+		# than in prestashed.  They are also in prestash_expanded
+		# with target = configured = label:LABEL and fetch_tickets()
+		# resolves the host's labels when it looks them up.
+
+		$dbh->do(qq{
+			CREATE TABLE prestash_labels (
+				principal	VARCHAR NOT NULL,
+				target		VARCHAR NOT NULL,
+				realm		VARCHAR,
+
+				PRIMARY KEY (principal, target)
+			)
+		});
+
+		$dbh->do(qq{
+			CREATE INDEX prestash_labels_target
+			ON prestash_labels(target, realm)
+		});
+	},
+	sub {
+		my ($dbh) = @_;
+
+		#
+		# kdb_generation is bumped after every write that we make to
+		# the KDB so that the query() caches of the other processes
+		# can tell that they are stale.
+
+		$dbh->do(qq{
+			CREATE TABLE kdb_generation (
+				id		INTEGER PRIMARY KEY
+						CHECK (id = 0),
+				generation	INTEGER NOT NULL
+			)
+		});
+
+		$dbh->do(qq{
+			INSERT INTO kdb_generation (id, generation)
+			VALUES (0, 0)
+		});
+	},
+);
+
+sub upgrade_db {
+	my ($self) = @_;
+	my $dbh = $self->{dbh};
+
+	my ($version) = $dbh->selectrow_array("PRAGMA user_version");
+
+	return if $version >= @schema_upgrades;
+
+	eval {
+		for my $i ($version .. $#schema_upgrades) {
+			&{$schema_upgrades[$i]}($dbh);
+		}
+
+		$dbh->do("PRAGMA user_version = " . scalar(@schema_upgrades));
+		$dbh->commit();
+	};
+
+	if (my $err = $@) {
+		$dbh->rollback();
+		die $err;
+	}
+
 	return undef;
 }
 
@@ -437,10 +896,16 @@ sub drop_db {
 	# XXXrcd: should we unlink(2) the Kerberos DB?  Maybe not.
 
 	$dbh->{AutoCommit} = 1;
+	$dbh->do('DROP TABLE IF EXISTS kdb_generation');
+	$dbh->do('DROP TABLE IF EXISTS prestash_labels');
+	$dbh->do('DROP TABLE IF EXISTS prestash_shared');
+	$dbh->do('DROP TABLE IF EXISTS prestash_expanded');
+	$dbh->do('DROP TABLE IF EXISTS hostmap_closure');
 	$dbh->do('DROP TABLE IF EXISTS prestashed');
 	$dbh->do('DROP TABLE IF EXISTS hostmap');
 	$dbh->do('DROP TABLE IF EXISTS host_labels');
 	$dbh->do('DROP TABLE IF EXISTS hosts');
+	$dbh->do('PRAGMA user_version = 0');
 	$dbh->{AutoCommit} = 0;
 }
 
@@ -509,6 +974,8 @@ sub internal_create {
 	my $ctx  = $self->{ctx};
 	my $hndl = $self->{hndl};
 
+	$self->query_cache_invalidate($name);
+
 	#
 	# If we are not provided with a public key, we simply create a
 	# principal with a random key.  This can be used when knowledge
@@ -517,6 +984,7 @@ sub internal_create {
 
 	if (!exists($args{public})) {
 		Krb5Admin::C::krb5_createkey($ctx, $hndl, $name);
+		$self->kdb_changed();
 		syslog('info', "%s", $self->{client} . " created $name");
 		return undef;
 	}
@@ -541,6 +1009,7 @@ sub internal_create {
 		Krb5Admin::C::krb5_setpass($ctx, $hndl, $name, $kvno,
 		    $args{enctypes}, $passwd);
 	}
+	$self->kdb_changed();
 
 	syslog('info', "%s", $self->{client} . " created $name");
 	return undef;
@@ -555,12 +1024,14 @@ sub create_user {
 	die "malformed name"	if $name =~ m,[^-A-Za-z0-9_/@.],;
 
 	$self->check_acl('create_user', $name);
+	$self->query_cache_invalidate($name);
 	my $ret = Krb5Admin::C::krb5_createprinc($ctx, $hndl, {
 			principal	=> $name,
 			policy		=> 'default',
 			attributes	=> REQUIRES_PRE_AUTH | DISALLOW_SVR |
 					   REQUIRES_PWCHANGE,
 		}, [], $passwd);
+	$self->kdb_changed();
 	syslog('info', "%s", $self->{client} . " created $name");
 	$ret;
 }
@@ -585,6 +1056,7 @@ sub create_bootstrap_id {
 	# be used by WELLKNOWN/ANONYMOUS@REALM.
 
 	$self->check_acl('create_bootstrap_id');
+	my $token = $self->admit('create_bootstrap_id');
 
 	#
 	# XXXrcd: For now, we require that enctypes are aes256-cts (18) only.
@@ -609,7 +1081,8 @@ sub create_bootstrap_id {
 
 		eval {
 			Krb5Admin::C::krb5_query_princ($ctx, $hndl,
-			    unparse_princ([$realm, "krbtgt", $realm]));
+			    Krb5Admin::C::unparse_name($ctx,
+			    [$realm, "krbtgt", $realm]));
 		};
 
 		if ($@) {
@@ -661,13 +1134,13 @@ sub create_bootstrap_id {
 		$tmpname .= '/' . $rnd;
 		$tmpname .= '@' . $realm	if defined($realm);
 
-		$tmpname = unparse_princ([Krb5Admin::C::krb5_parse_name($ctx,
-		    $tmpname)]);
+		($tmpname) = Krb5Admin::C::parse_name_canon($ctx, $tmpname);
 
 		#
 		# XXXrcd: maybe we should use a passwd policy that rejects all
 		#         passwd change requests?
 
+		$self->query_cache_invalidate($tmpname);
 		eval {
 			Krb5Admin::C::krb5_createprinc($ctx, $hndl, {
 					principal  => $tmpname,
@@ -680,6 +1153,7 @@ sub create_bootstrap_id {
 		};
 
 		if (!$@) {
+			$self->kdb_changed();
 			$princ = $tmpname;
 		}
 
@@ -720,7 +1194,7 @@ sub bootstrap_host_key {
 
 	$self->check_acl('bootstrap_host_key', $princ);
 
-	my ($realm, $h, $host) = Krb5Admin::C::krb5_parse_name($ctx, $princ);
+	my ($realm, $h, $host) = Krb5Admin::C::parse_name($ctx, $princ);
 
 	#
 	# XXXrcd: any more ACLs?  Fix how we determine the realm.
@@ -733,7 +1207,7 @@ sub bootstrap_host_key {
 	#         bootstrap key from the Kerberos database.
 
 	$stmt = "UPDATE hosts SET bootbinding = NULL WHERE name = ?";
-	sql_command($dbh, $stmt, $host);
+	sql_cached($dbh, $stmt, $host);
 	$dbh->commit();
 
 	#
@@ -746,10 +1220,14 @@ sub bootstrap_host_key {
 	# counter instead of a random number, perhaps...
 
 	$stmt = "SELECT COUNT(name) FROM hosts WHERE bootbinding = ?";
-	$sth = sql_command($dbh, $stmt, $binding);
+	$sth = sql_cached($dbh, $stmt, $binding);
+	my $count = $sth->fetch()->[0];
+	$sth->finish();
 
-	if ($sth->fetch()->[0] == 0) {
+	if ($count == 0) {
+		$self->query_cache_invalidate($binding);
 		Krb5Admin::C::krb5_deleteprinc($ctx, $hndl, $binding);
+		$self->kdb_changed();
 	}
 
 	return undef;
@@ -801,6 +1279,7 @@ sub change {
 
 	require_scalar("change <princ>", 1, $name);
 	$self->check_acl('change', $name);
+	$self->query_cache_invalidate($name);
 
 	my %args;
 	if (@args == 1) {
@@ -827,6 +1306,7 @@ sub change {
 	if (exists($args{keys})) {
 		Krb5Admin::C::krb5_setkey($ctx, $hndl, $name, $kvno,
 		    $args{keys});
+		$self->kdb_changed();
 		return undef;
 	}
 
@@ -838,6 +1318,7 @@ sub change {
 
 	Krb5Admin::C::krb5_setpass($ctx, $hndl, $name, $kvno, $args{enctypes},
 	    $passwd);
+	$self->kdb_changed();
 
 	return undef;
 }
@@ -856,12 +1337,14 @@ sub change_passwd {
 	}
 
 	$self->check_acl('change_passwd', $name);
+	$self->query_cache_invalidate($name);
 
 	if (defined($passwd)) {
 		Krb5Admin::C::krb5_setpass($ctx, $hndl, $name, -1, [], $passwd);
 	} else {
 		$passwd = Krb5Admin::C::krb5_randpass($ctx, $hndl, $name, []);
 	}
+	$self->kdb_changed();
 
 	return $passwd if !defined($opt);
 
@@ -880,7 +1363,9 @@ sub reset_passwd {
 	require_scalar("reset_passwd <princ>", 1, $name);
 
 	$self->check_acl('reset_passwd', $name);
+	$self->query_cache_invalidate($name);
 	my $passwd = Krb5Admin::C::krb5_randpass($ctx, $hndl, $name, []);
+	$self->kdb_changed();
 	$self->internal_modify($name, {attributes => [ '+needchange' ]});
 
 	return $passwd;
@@ -905,6 +1390,8 @@ sub internal_modify {
 	# XXXrcd: MUST LOCK BEFORE DOING THESE OPERATIONS
 	# XXXrcd: SANITY CHECK VALUES!
 
+	$self->query_cache_invalidate($name);
+
 	my $tmp = Krb5Admin::C::krb5_query_princ($ctx, $hndl, $name);
 	my $attrs = $tmp->{attributes};
 
@@ -927,13 +1414,177 @@ sub internal_modify {
 	$mods->{principal}  = $name;
 
 	Krb5Admin::C::krb5_modprinc($ctx, $hndl, $mods);
+	$self->kdb_changed();
 	return undef;
 }
 
+#
+# query() results are cached per process, keyed by the database and the
+# canonical name of the principal.  Only the metadata is kept: the keys
+# are reduced to their kvno and enctype before they are stored and we
+# never cache the output of fetch().  Every method that writes to the
+# KDB through kadm5 calls query_cache_invalidate() before it does so and
+# kdb_changed() once it has, which bumps the generation in the SQL DB.
+# Writes made by kadmin and kpasswdd do not touch the SQL DB but, like
+# ours, are appended to the kadm5 log and so we also track the version
+# of its last entry.  Each lookup reads both, which is cheap compared to
+# kadm5, and the cache is flushed if either has moved on since the cache
+# was filled.  Writes that bypass kadm5, such as those of the KDC
+# itself, are not seen and so any entry is discarded after
+# QUERY_CACHE_TTL seconds.  If the SQL DB has not been upgraded to have
+# a generation, we do not cache.  When the cache is full, we evict an
+# arbitrary entry for each one that we add so that a scan of a large
+# realm by mquery() does not keep flushing it.
+
+our %query_cache;
+our %query_cache_stats = (hits => 0, misses => 0, flushes => 0);
+
+sub kdb_generation {
+	my ($self) = @_;
+
+	my ($gen) = eval {
+		$self->{gen_dbh}->selectrow_array(qq{
+			SELECT generation FROM kdb_generation WHERE id = 0
+		});
+	};
+
+	return $gen;
+}
+
+#
+# kadm5_log_version() returns a string that changes whenever an entry is
+# appended to the kadm5 log.  Each entry ends with its version as a 32
+# bit big endian integer and so we read the last four bytes.  We add the
+# inode and size of the log so that a log that has been truncated or
+# replaced is noticed too.  It is empty if there is no log to read.
+
+sub kadm5_log_version {
+	my ($self) = @_;
+	my $buf = '';
+	my $fh;
+
+	my $log = eval {
+		Krb5Admin::C::kadm5_log_file($self->{ctx}, $self->{hndl});
+	};
+
+	return '' if !defined($log) || !open($fh, '<', $log);
+
+	my @st = stat($fh);
+	if (@st && $st[7] >= 4 && sysseek($fh, -4, SEEK_END)) {
+		sysread($fh, $buf, 4);
+	}
+	close($fh);
+
+	return '' if !@st;
+	return join(':', @st[1, 7], length($buf) == 4 ? unpack('N', $buf) : '');
+}
+
+#
+# kdb_changed() is called after each write to the KDB.  None of its
+# callers have SQL changes outstanding when they write to the KDB and so
+# we can simply commit.
+
+sub kdb_changed {
+	my ($self) = @_;
+	my $dbh = $self->{dbh};
+
+	eval {
+		sql_cached($dbh, qq{
+			UPDATE kdb_generation SET generation = generation + 1
+			WHERE id = 0
+		});
+		$dbh->commit();
+	};
+}
+
+sub query_cache {
+	my ($self) = @_;
+	my $dbname = defined($self->{dbname}) ? $self->{dbname} : '';
+	my $gen = $self->kdb_generation();
+
+	return undef if !defined($gen);
+
+	$gen .= '/' . $self->kadm5_log_version();
+
+	my $cache = $query_cache{$dbname};
+	if (!defined($cache) || $cache->{gen} ne $gen) {
+		$query_cache_stats{flushes}++	if defined($cache);
+		$cache = { gen => $gen, princs => {} };
+		$query_cache{$dbname} = $cache;
+	}
+
+	return $cache->{princs};
+}
+
+sub query_cache_invalidate {
+	my ($self, @princs) = @_;
+	my $dbname = defined($self->{dbname}) ? $self->{dbname} : '';
+	my $cache = $query_cache{$dbname};
+
+	return if !defined($cache);
+
+	for my $princ (@princs) {
+		my ($canon) = eval {
+			Krb5Admin::C::parse_name_canon($self->{ctx}, $princ);
+		};
+
+		#
+		# If we cannot parse the name then we cannot know which
+		# entry it refers to and so we drop them all.
+
+		if (!defined($canon)) {
+			$cache->{princs} = {};
+			return;
+		}
+
+		delete $cache->{princs}->{$canon};
+	}
+}
+
+sub query_cache_stats {
+	my ($self) = @_;
+	my $entries = 0;
+
+	$entries += keys %{$_->{princs}} for values %query_cache;
+
+	return { %query_cache_stats, entries => $entries };
+}
+
+sub copy_princ {
+	my ($princ) = @_;
+
+	return {
+		%$princ,
+		attributes => [ @{$princ->{attributes}} ],
+		keys       => [ map {
+			{ kvno => $_->{kvno}, enctype => $_->{enctype} }
+		} @{$princ->{keys}} ],
+	};
+}
+
+#
+# admit() asks the scheduler, if we have one, for permission to run an
+# expensive call.  The call holds the returned token until it is done.
+
+sub admit {
+	my ($self, $verb, @args) = @_;
+
+	return undef if !defined($self->{scheduler});
+	return $self->{scheduler}->admit($verb, @args);
+}
+
+sub scheduler_stats {
+	my ($self) = @_;
+
+	return undef if !defined($self->{scheduler});
+	return $self->{scheduler}->stats();
+}
+
 sub mquery {
 	my ($self, @args) = @_;
 
 	$self->check_acl('mquery', @args);
+	my $token = $self->admit('mquery', @args);
 
 	@args = ('*')	if scalar(@args) == 0;	# empty args is a wildcard.
 
@@ -948,6 +1599,59 @@ sub mquery {
 	@ret;
 }
 
+#
+# batch() runs a list of calls on behalf of the client.  We do not check
+# an ACL for the batch itself as each of the methods that we call does
+# its own check.  Only the read-only methods may be batched, which stops
+# a batch from being used to perform writes on a slave, and the methods
+# are called in the same context in which Kharon would have called them.
+
+sub batch {
+	my ($self, @calls) = @_;
+	my $dbh = $self->{dbh};
+	my %sc = map { $_ => 1 } @Krb5Admin::KHARON_RO_SC_EXPORT;
+	my %ac = map { $_ => 1 } @Krb5Admin::KHARON_RO_AC_EXPORT;
+	my @ret;
+
+	delete $ac{batch};
+
+	if (@calls > Krb5Admin::BATCH_MAX_CALLS) {
+		die [500, 'limit exceeded: you can only make ' .
+			  Krb5Admin::BATCH_MAX_CALLS . ' calls in one batch'];
+	}
+
+	for my $call (@calls) {
+		if (ref($call) ne 'ARRAY' || !defined($call->[0]) ||
+		    !($sc{$call->[0]} || $ac{$call->[0]})) {
+			push(@ret, {error => [503, "Syntax error: batch " .
+			    "calls must be [method, args] of a read-only " .
+			    "method"]});
+			next;
+		}
+
+		my ($method, @args) = @$call;
+		my $result;
+
+		eval {
+			if ($sc{$method}) {
+				$result = $self->$method(@args);
+			} else {
+				$result = [$self->$method(@args)];
+			}
+		};
+
+		if ($@) {
+			push(@ret, {error => $@});
+			$dbh->rollback()	if !$dbh->{AutoCommit};
+			next;
+		}
+
+		push(@ret, {result => $result});
+	}
+
+	return @ret;
+}
+
 sub query {
 	my ($self, $name) = @_;
 	my $ctx  = $self->{ctx};
@@ -955,6 +1659,19 @@ sub query {
 
 	require_scalar("query <princ>", 1, $name);
 	$self->check_acl('query', $name);
+
+	my ($canon) = Krb5Admin::C::parse_name_canon($ctx, $name);
+	my $cache = $self->query_cache() || {};
+	my $hit = $cache->{$canon};
+
+	if (defined($hit) && $hit->{expires} > time()) {
+		$query_cache_stats{hits}++;
+		return copy_princ($hit->{princ});
+	}
+
+	$query_cache_stats{misses}++;
+	delete $cache->{$canon};
+
 	my $ret = Krb5Admin::C::krb5_query_princ($ctx, $hndl, $name);
 
 	#
@@ -974,6 +1691,15 @@ sub query {
 		{ kvno => $_->{kvno}, enctype => $_->{enctype} }
 	} @tmp ];
 
+	if (keys %$cache >= QUERY_CACHE_MAX) {
+		my ($victim) = each %$cache;
+		delete $cache->{$victim};
+	}
+	$cache->{$canon} = {
+		expires	=> time() + QUERY_CACHE_TTL,
+		princ	=> copy_princ($ret),
+	};
+
 	$ret;
 }
 
@@ -1005,9 +1731,11 @@ sub disable {
 
 		$adm_princ .= $2 if defined($2);
 
+		$self->query_cache_invalidate($adm_princ);
 		eval {
 			Krb5Admin::C::krb5_deleteprinc($ctx,
 			    $hndl, $adm_princ);
+			$self->kdb_changed();
 		};
 	}
 
@@ -1021,7 +1749,9 @@ sub remove {
 
 	require_scalar("remove <princ>", 1, $name);
 	$self->check_acl('remove', $name);
+	$self->query_cache_invalidate($name);
 	Krb5Admin::C::krb5_deleteprinc($ctx, $hndl, $name);
+	$self->kdb_changed();
 	return undef;
 }
 
@@ -1047,6 +1777,10 @@ sub create_host {
 
 	require_scalar("create_host <host> [args]", 1, $host);
 
+	if (defined(_target_label($host))) {
+		die [503, "Host names may not begin with label:"];
+	}
+
 	# XXXrcd: more checking should be done.
 
 	$self->check_acl('create_host', $host, %args);
@@ -1072,19 +1806,113 @@ sub create_host {
 	return undef;
 }
 
-sub modify_host {
-	my ($self, $host, %args) = @_;
+#
+# create_hosts() registers many hosts in a single transaction using
+# multi-row INSERTs.  Each host is a hash reference of the fields of
+# hosts and, optionally, label.  Rather than failing the whole call, the
+# hosts which are malformed or which already exist are skipped and we
+# return an array reference with an element per host which is undef if
+# it was created and the error, as it would have been thrown, if not.
+
+sub create_hosts {
+	my ($self, $hosts) = @_;
 	my $dbh = $self->{dbh};
+	my $usage = "create_hosts [{name => <host>, ...}, ...]";
 
-	require_scalar("modify_host <host> [args]", 1, $host);
+	if (ref($hosts) ne 'ARRAY') {
+		die [503, "Syntax error: arg 1 not an array ref\n" .
+		    "usage: $usage"];
+	}
 
-	$self->check_acl('modify_host', $host, %args);
+	my @cols = @{$field_desc{hosts}->{fields}};
+	my %fields = map { $_ => 1 } @cols;
+	my @ret = map { undef } @$hosts;
+	my %seen;
 
-	internal_modify_host($self, $host, %args);
-	$dbh->commit();
+	for my $i (0 .. $#$hosts) {
+		my $host = $hosts->[$i];
 
-	return undef;
-}
+		eval {
+			require_hashref($usage, $i + 1, $host);
+			require_scalar($usage, $i + 1, $host->{name});
+			require_scalar($usage, $i + 1, $host->{realm});
+
+			if (defined(_target_label($host->{name}))) {
+				die [503, "Host names may not begin with " .
+				    "label:"];
+			}
+
+			for my $k (keys %$host) {
+				if ($k eq 'label') {
+					my $l = $host->{label};
+
+					next if ref($l) eq 'ARRAY' && !grep {
+						!defined($_) || ref($_)
+					} @$l;
+					die [503, "label takes an array ref"];
+				}
+
+				if (!$fields{$k}) {
+					die [503, "Unrecognised field: $k"];
+				}
+
+				require_scalar($usage, $i + 1, $host->{$k})
+				    if defined($host->{$k});
+			}
+
+			if ($seen{$host->{name}}++) {
+				die [500, "Host $host->{name} is listed " .
+				    "twice."];
+			}
+		};
+
+		$ret[$i] = $@	if $@;
+	}
+
+	my @ok = grep { !defined($ret[$_]) } (0 .. $#$hosts);
+
+	$self->check_acl('create_host', map { $hosts->[$_]->{name} } @ok);
+
+	my %exists = _host_realms($dbh, map { $hosts->[$_]->{name} } @ok);
+
+	@ok = grep {
+		my $name = $hosts->[$_]->{name};
+
+		$ret[$_] = [500, "Host $name already exists."]
+		    if exists($exists{$name});
+		!defined($ret[$_]);
+	} @ok;
+
+	sql_bulk_insert($dbh, 'hosts', \@cols, map {
+		my $host = $hosts->[$_];
+
+		[ map { $host->{$_} } @cols ];
+	} @ok);
+
+	sql_bulk_insert_ignore($dbh, 'host_labels', [qw/host label/], map {
+		my $host = $hosts->[$_];
+
+		map { [$host->{name}, $_] } @{$host->{label} || []};
+	} @ok);
+
+	$dbh->commit();
+
+	return \@ret;
+}
+
+sub modify_host {
+	my ($self, $host, %args) = @_;
+	my $dbh = $self->{dbh};
+
+	require_scalar("modify_host <host> [args]", 1, $host);
+
+	$self->check_acl('modify_host', $host, %args);
+
+	internal_modify_host($self, $host, %args);
+	$dbh->commit();
+
+	return undef;
+}
 
 sub internal_modify_host {
 	my ($self, $host, %args) = @_;
@@ -1105,9 +1933,6 @@ sub internal_modify_host {
 			if (ref($args{$arg}) ne 'ARRAY') {
 				die [503, "label takes an array ref"];
 			}
-			if (@add_label) {
-				die [503, "Can't both set label and add label"];
-			}
 			$set_label = 1;
 			push(@add_label, @{$args{$arg}});
 			next;
@@ -1137,7 +1962,8 @@ sub internal_modify_host {
 		push(@bindv, $args{$arg});
 	}
 
-	if (@add_label || @del_label) {
+	if ($set_label && (exists($args{add_label}) ||
+	    exists($args{del_label}))) {
 		die [503, "Can't both add/del label and set label"];
 	}
 
@@ -1152,17 +1978,15 @@ sub internal_modify_host {
 		sql_command($dbh, $stmt, $host);
 	}
 
-	for my $label (@add_label) {
-		my $stmt = "INSERT INTO host_labels(host, label) VALUES (?, ?)";
-		sql_command($dbh, $stmt, $host, $label);
-	}
+	my %seen;
+	sql_bulk_insert($dbh, 'host_labels', [qw/host label/],
+	    map { [$host, $_] } grep { !$seen{$_}++ } @add_label);
 
-	if (@del_label) {
-		my $stmt = qq{
-				DELETE FROM host_labels
-				WHERE host = ? AND ( } .
-		    join(' OR ', map { "label = ?" } (@del_label)) . ")";
-		sql_command($dbh, $stmt, $host, @del_label);
+	for my $chunk (sql_chunks(1, 1, @del_label)) {
+		sql_uncached($dbh, qq{
+			DELETE FROM host_labels
+			WHERE host = ? AND label IN (} .
+		    join(',', map { '?' } @$chunk) . ")", $host, @$chunk);
 	}
 
 	return undef;
@@ -1172,10 +1996,154 @@ sub query_host {
 	my ($self, %query) = @_;
 	my $dbh = $self->{dbh};
 
+	return $self->query_host_label(%query)	if exists($query{label});
+
 	return generic_query($dbh, \%field_desc, 'hosts', [keys %query],
 	    %query);
 }
 
+#
+# query_host_label() selects hosts by label.  The hosts are found in a
+# sub-select driven by the host_labels_label index which groups the
+# matching rows by host and, if we must match all of the labels, keeps
+# only the hosts which have all of them.  The result is then joined
+# back onto hosts and host_labels so that each host is returned with
+# all of its labels in the one statement.
+
+sub query_host_label {
+	my ($self, %query) = @_;
+	my $dbh = $self->{dbh};
+
+	my $labels = delete $query{label};
+	my $match  = delete $query{match};
+
+	$labels = [$labels]		if ref($labels) ne 'ARRAY';
+	$match  = 'all'			if !defined($match);
+
+	my %seen;
+	my @labels = grep { !$seen{$_}++ } @$labels;
+
+	if (@labels == 0 || grep { !defined($_) || ref($_) } @labels) {
+		die [503, "label takes a label or an array ref of labels"];
+	}
+
+	if ($match ne 'all' && $match ne 'any') {
+		die [503, "match must be either all or any"];
+	}
+
+	#
+	# The count is put into the statement rather than bound as it would
+	# be bound as TEXT and never equal COUNT(*).
+
+	my @bindv = @labels;
+	my $having = '';
+	$having = "HAVING COUNT(*) = " . scalar(@labels) if $match eq 'all';
+
+	my $where = '';
+	for my $field (sort keys %query) {
+		if (!grep { $_ eq $field } (@{$field_desc{hosts}->{fields}})) {
+			die [503, "Unrecognised field: $field"];
+		}
+
+		$where .= " AND hosts.$field = ?";
+		push(@bindv, $query{$field});
+	}
+
+	if (@bindv > SQL_MAX_BINDV) {
+		die [503, "Too many labels in a single query"];
+	}
+
+	my $stmt = qq{
+		SELECT hosts.name AS name, hosts.realm AS realm,
+		       hosts.ip_addr AS ip_addr,
+		       hosts.bootbinding AS bootbinding,
+		       host_labels.label AS label
+		FROM (
+			SELECT host FROM host_labels
+			WHERE label IN (} .
+			    join(',', map { '?' } @labels) . qq{)
+			GROUP BY host $having
+		) AS matched
+		JOIN hosts ON hosts.name = matched.host
+		JOIN host_labels ON host_labels.host = hosts.name
+		WHERE 1 = 1 $where
+		ORDER BY hosts.name, host_labels.label
+	};
+
+	my $sth = sql_uncached($dbh, $stmt, @bindv);
+
+	my %ret;
+	for my $row (@{$sth->fetchall_arrayref({})}) {
+		my $host = $ret{$row->{name}} ||= {
+			realm		=> $row->{realm},
+			ip_addr		=> $row->{ip_addr},
+			bootbinding	=> $row->{bootbinding},
+			label		=> [],
+		};
+
+		push(@{$host->{label}}, $row->{label});
+	}
+
+	return \%ret;
+}
+
+#
+# insert_host_label() and remove_host_label() add or remove a single
+# label on many hosts at once, using multi-row statements, which is how
+# an inventory system will generally want to manage them.
+
+sub insert_host_label {
+	my ($self, $label, @hosts) = @_;
+	my $dbh = $self->{dbh};
+	my $usage = "insert_host_label <label> <host> [<host> ...]";
+
+	require_scalar($usage, 1, $label);
+	for (my $i = 0; $i <= $#hosts || $i == 0; $i++) {
+		require_scalar($usage, $i + 2, $hosts[$i]);
+	}
+
+	$self->check_acl('insert_host_label', $label, @hosts);
+
+	my %hrealm = _host_realms($dbh, @hosts);
+
+	if (my ($missing) = grep { !exists($hrealm{$_}) } @hosts) {
+		$dbh->rollback();
+		_deny_nohost($missing);
+	}
+
+	my %seen;
+	sql_bulk_insert_ignore($dbh, 'host_labels', [qw/host label/],
+	    map { [$_, $label] } grep { !$seen{$_}++ } @hosts);
+
+	$dbh->commit();
+
+	return undef;
+}
+
+sub remove_host_label {
+	my ($self, $label, @hosts) = @_;
+	my $dbh = $self->{dbh};
+	my $usage = "remove_host_label <label> <host> [<host> ...]";
+
+	require_scalar($usage, 1, $label);
+	for (my $i = 0; $i <= $#hosts || $i == 0; $i++) {
+		require_scalar($usage, $i + 2, $hosts[$i]);
+	}
+
+	$self->check_acl('remove_host_label', $label, @hosts);
+
+	for my $chunk (sql_chunks(1, 1, @hosts)) {
+		sql_uncached($dbh, qq{
+			DELETE FROM host_labels
+			WHERE label = ? AND host IN (} .
+		    join(',', map { '?' } @$chunk) . ")", $label, @$chunk);
+	}
+
+	$dbh->commit();
+
+	return undef;
+}
+
 sub bind_host {
 	my ($self, $host, $binding) = @_;
 	my $ctx = $self->{ctx};
@@ -1213,19 +2181,125 @@ sub remove_host {
 
 	$self->check_acl('remove_host', @hosts);
 
-	while (@hosts) {
-		my @curhosts = splice(@hosts, 0, 500);
+	#
+	# Hosts which are still in the hostmap or which still have tickets
+	# prestashed on them are left alone, as are hosts that do not
+	# exist, and we return an error for each.  A host's labels are
+	# removed along with it.  The deletes are done with IN rather than
+	# ORs as SQLite can then use the primary key.
 
-		sql_command($dbh, "DELETE FROM hosts WHERE "
-		    . join(' OR ', map {"name=?"} @curhosts), @curhosts);
+	my %exists = _host_realms($dbh, @hosts);
+	my %busy;
 
-		#
-		# XXXrcd: error handling and all that.
+	for my $ref (['hostmap', 'logical'], ['hostmap', 'physical'],
+	    ['prestashed', 'host']) {
+		my ($table, $col) = @$ref;
+
+		for my $chunk (sql_chunks(1, 0, keys %exists)) {
+			my $sth = sql_uncached($dbh, "SELECT DISTINCT $col " .
+			    "FROM $table WHERE $col IN (" .
+			    join(',', map { '?' } @$chunk) . ")", @$chunk);
+
+			$busy{$_->[0]} = 1 for @{$sth->fetchall_arrayref()};
+		}
+	}
+
+	my @ret = map {
+		!exists($exists{$_}) ? [500, "Host $_ does not exist."] :
+		$busy{$_} ? [500, "Host $_ is still in use by the hostmap " .
+		    "or has prestashed tickets."] : undef;
+	} @hosts;
+
+	my @del = grep { !$busy{$_} } keys %exists;
+
+	for my $chunk (sql_chunks(1, 0, @del)) {
+		my $in = join(',', map { '?' } @$chunk);
+
+		sql_uncached($dbh,
+		    "DELETE FROM host_labels WHERE host IN ($in)", @$chunk);
+		sql_uncached($dbh, "DELETE FROM hosts WHERE name IN ($in)",
+		    @$chunk);
 	}
 
 	$dbh->commit();
 
-	return;
+	return \@ret;
+}
+
+#
+# _hostmap_loops() returns true if mapping $logical onto $physical would
+# create a loop in the hostmap, i.e. $physical already reaches $logical.
+
+sub _hostmap_loops {
+	my ($dbh, $logical, $physical) = @_;
+
+	return 1 if $logical eq $physical;
+
+	my $sth = sql_cached($dbh, qq{
+		SELECT COUNT(*) FROM hostmap_closure
+		WHERE logical = ? AND physical = ?
+	}, $physical, $logical);
+	my $count = $sth->fetchrow_arrayref()->[0];
+	$sth->finish();
+
+	return $count > 0;
+}
+
+#
+# _hostmap_closure_edge() adds ($sign == 1) or removes ($sign == -1) the
+# edge $logical -> $physical from hostmap_closure.  Every host that
+# reaches $logical (and $logical itself) gains or loses the paths to
+# every host reached from $physical (and $physical itself).  We return
+# the list of [logical, physical] pairs which have been added to or
+# removed from the closure so that the caller can fix prestash_expanded.
+
+sub _hostmap_closure_edge {
+	my ($dbh, $logical, $physical, $sign) = @_;
+	my $sth;
+	my @changed;
+
+	$sth = sql_cached($dbh, qq{
+		SELECT logical, paths FROM hostmap_closure WHERE physical = ?
+	}, $logical);
+	my @above = ([$logical, 1], @{$sth->fetchall_arrayref()});
+
+	$sth = sql_cached($dbh, qq{
+		SELECT physical, paths FROM hostmap_closure WHERE logical = ?
+	}, $physical);
+	my @below = ([$physical, 1], @{$sth->fetchall_arrayref()});
+
+	for my $x (@above) {
+		for my $y (@below) {
+			my $paths = $sign * $x->[1] * $y->[1];
+
+			$sth = sql_cached($dbh, qq{
+				UPDATE hostmap_closure SET paths = paths + ?
+				WHERE logical = ? AND physical = ?
+			}, $paths, $x->[0], $y->[0]);
+
+			next if $sth->rows > 0 || $sign < 0;
+
+			sql_cached($dbh, qq{
+				INSERT INTO hostmap_closure
+				    (logical, physical, paths)
+				VALUES (?, ?, ?)
+			}, $x->[0], $y->[0], $paths);
+
+			push(@changed, [$x->[0], $y->[0]]);
+		}
+	}
+
+	if ($sign < 0) {
+		$sth = sql_cached($dbh, qq{
+			SELECT logical, physical FROM hostmap_closure
+			WHERE paths <= 0
+		});
+		@changed = @{$sth->fetchall_arrayref()};
+
+		sql_cached($dbh, "DELETE FROM hostmap_closure WHERE paths <= 0");
+	}
+
+	return @changed;
 }
 
 sub insert_hostmap {
@@ -1239,9 +2313,23 @@ sub insert_hostmap {
 
 	$self->check_acl('insert_hostmap', @hosts);
 
+	if (_hostmap_loops($dbh, @hosts[0,1])) {
+		die [504, "Mapping $hosts[0] onto $hosts[1] would create " .
+		    "a loop in the hostmap."];
+	}
+
 	my $stmt = "INSERT INTO hostmap (logical, physical) VALUES (?, ?)";
 
-	sql_command($dbh, $stmt, @hosts);
+	sql_cached($dbh, $stmt, @hosts);
+
+	for my $pair (_hostmap_closure_edge($dbh, @hosts[0,1], 1)) {
+		sql_cached($dbh, qq{
+			INSERT OR IGNORE INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT ?, realm, principal, host FROM prestashed
+			WHERE host = ?
+		}, $pair->[1], $pair->[0]);
+	}
 
 	$dbh->commit();
 
@@ -1275,7 +2363,19 @@ sub remove_hostmap {
 
 	my $stmt = "DELETE FROM hostmap WHERE logical = ? AND physical = ?";
 
-	sql_command($dbh, $stmt, @hosts);
+	my $sth = sql_cached($dbh, $stmt, @hosts);
+
+	if ($sth->rows == 0) {
+		$dbh->rollback();
+		return;
+	}
+
+	for my $pair (_hostmap_closure_edge($dbh, @hosts[0,1], -1)) {
+		sql_cached($dbh, qq{
+			DELETE FROM prestash_expanded
+			WHERE configured = ? AND target = ?
+		}, @$pair);
+	}
 
 	$dbh->commit();
 
@@ -1295,38 +2395,94 @@ sub _deny_nohost {
 	    " Please contact your system administrator."];
 }
 
+#
+# _host_realms() returns a hash mapping each of @hosts which exists to
+# its realm.  It uses one query per chunk of SQL_MAX_BINDV hosts rather
+# than one per host.  _check_hosts() uses it to validate @hosts and
+# reports errors in the order of @hosts, as they would be if we checked
+# them one by one.
+
+sub _host_realms {
+	my ($dbh, @hosts) = @_;
+	my %hrealm;
+	my %seen;
+
+	for my $chunk (sql_chunks(1, 0, grep { !$seen{$_}++ } @hosts)) {
+		my $stmt = "SELECT name, realm FROM hosts WHERE name IN (" .
+		    join(',', map { '?' } @$chunk) . ")";
+
+		my $sth = sql_uncached($dbh, $stmt, @$chunk);
+
+		for my $row (@{$sth->fetchall_arrayref()}) {
+			$hrealm{$row->[0]} = $row->[1];
+		}
+	}
+
+	return %hrealm;
+}
+
 sub _check_hosts {
 	my ($self, $princ, $prealm, $realms, @hosts) = @_;
 	my $dbh = $self->{dbh};
-	my $stmt = "SELECT realm FROM hosts WHERE name = ?";
-	my $sth = eval { $dbh->prepare($stmt); };
-	my $deny;
+	my %hrealm = _host_realms($dbh, @hosts);
 
-	if (!defined($sth)) {
-		$dbh->rollback();
-		die [510, "SQL ERROR: ".$dbh->errstr];
-	}
-
-	my $hrealm;
-	$sth->bind_columns(\$hrealm);
 	eval {
 		for my $host (@hosts) {
-			$sth->execute($host);
-			if (! $sth->fetch) {
+			if (!exists($hrealm{$host})) {
 				_deny_nohost($host);
 			}
-			if (!grep($_ eq $hrealm, @$realms)) {
-				_deny_xrealm($princ, $prealm, $host, $hrealm);
+
+			my $hr = $hrealm{$host};
+			if (!defined($hr) || !$realms->{$hr}) {
+				_deny_xrealm($princ, $prealm, $host, $hr);
 			}
 		}
 	};
-	$deny = $@ if $@;
-	$deny = [510, "SQL ERROR: ".$sth->errstr] if ($sth->err);
 
-	if ($deny) {
+	if ($@) {
 		$dbh->rollback();
-		die $deny;
+		die $@;
+	}
+}
+
+#
+# _target_label() returns the label if the prestash target $target is
+# a host label, i.e. label:LABEL, and undef if it is a host.
+
+sub _target_label {
+	my ($target) = @_;
+
+	return $1 if $target =~ /^label:(.+)$/;
+	return undef;
+}
+
+#
+# _label_hosts() returns a hash mapping each of the label targets in
+# @labels which is carried by at least one host to the list of those
+# hosts.  A label only exists while some host carries it.
+
+sub _label_hosts {
+	my ($dbh, @labels) = @_;
+	my %lhosts;
+
+	for my $chunk (sql_chunks(1, 0, map { _target_label($_) } @labels)) {
+		my $stmt = "SELECT label, host FROM host_labels " .
+		    "WHERE label IN (" . join(',', map { '?' } @$chunk) . ")";
+
+		my $sth = sql_uncached($dbh, $stmt, @$chunk);
+
+		for my $row (@{$sth->fetchall_arrayref()}) {
+			push(@{$lhosts{"label:$row->[0]"}}, $row->[1]);
+		}
 	}
+
+	return %lhosts;
+}
+
+sub _deny_nolabel {
+	my ($label) = @_;
+	die [504, "Label " . _target_label($label) . " is not carried by " .
+	    "any host in the krb5_admin database."];
 }
 
 sub insert_ticket {
@@ -1355,32 +2511,84 @@ sub insert_ticket {
 	# of each host. Otherwise, the realm of each host must be one of
 	# the explicitly configured list values.
 
-	my $prealm = [Krb5Admin::C::krb5_parse_name($self->{ctx}, $princ)]->[0];
-	my $realms = $self->{prestash_xrealm}->{$prealm};
-	$realms ||= [$prealm];
+	#
+	# The realms of label targets are not checked here, as the hosts
+	# which carry the label may change, but when the tickets are
+	# fetched.  We do insist that some host carries the label now
+	# so that a typo does not silently prestash onto nothing.
+
+	my @labels = grep { defined(_target_label($_)) } @hosts;
+	@hosts = grep { !defined(_target_label($_)) } @hosts;
+
+	my $prealm = [Krb5Admin::C::parse_name($self->{ctx}, $princ)]->[0];
+	my $realms = $self->{policy}->prestash_realms($prealm);
 	$self->_check_hosts($princ, $prealm, $realms, @hosts);
 
-	for my $host (map {lc($_)} @hosts) {
+	my %seen;
+	@hosts = grep { !$seen{$_}++ } map { lc($_) } @hosts;
+	@labels = grep { !$seen{$_}++ } @labels;
 
-		my $stmt = qq{
-			INSERT INTO prestashed (principal, host) VALUES (?, ?)
-		};
+	my %lhosts = _label_hosts($dbh, @labels);
+	for my $label (@labels) {
+		next if exists($lhosts{$label});
+
+		$dbh->rollback();
+		_deny_nolabel($label);
+	}
+
+	#
+	# We insert all of the rows with multi-row INSERTs and then check
+	# the per-host limit with a single query rather than a statement
+	# pair per host.  The tickets on a host are those prestashed on it
+	# and those prestashed on any of its labels, so a ticket on a label
+	# counts against each of the hosts which carry it.
 
-		my ($sth, $str) = sql_command($dbh, $stmt, $princ, $host);
+	sql_bulk_insert($dbh, 'prestashed', [qw/principal host realm/],
+	    map { [$princ, $_, $prealm] } @hosts);
 
-#		if (!$sth || ($str =~ /unique/)) {
-#			die [500, 'tickets already configured for prestash'];
-#		}
+	sql_bulk_insert($dbh, 'prestash_labels', [qw/principal target realm/],
+	    map { [$princ, $_, $prealm] } @labels);
 
-		($sth, $str) = sql_command($dbh,
-			"SELECT count(principal) FROM prestashed" .
-			" WHERE host = ?", $host);
+	sql_bulk_insert($dbh, 'prestash_expanded',
+	    [qw/target realm principal configured/],
+	    map { [$_, $prealm, $princ, $_] } (@hosts, @labels));
 
-		my ($count) = $sth->fetchrow_array();
-		die [500, 'limit exceeded: you can only prestash ' .
-			  MAX_TIX_PER_HOST .
-			  ' tickets on a single host or service address']
-			if ($count > MAX_TIX_PER_HOST);
+	for my $chunk (sql_chunks(1, 2, @hosts)) {
+		sql_uncached($dbh, qq{
+			INSERT OR IGNORE INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT physical, ?, ?, logical FROM hostmap_closure
+			WHERE logical IN (} . join(',', map { '?' } @$chunk) . qq{)
+		}, $prealm, $princ, @$chunk);
+	}
+
+	my @targets = grep { !$seen{$_}++ } map { @{$lhosts{$_}} } @labels;
+	unshift(@targets, @hosts);
+
+	for my $chunk (sql_chunks(1, 0, @targets)) {
+		my $stmt = qq{
+			SELECT name FROM hosts
+			WHERE name IN (} . join(',', map { '?' } @$chunk) . qq{)
+			AND (SELECT count(*) FROM (
+				SELECT principal FROM prestashed
+				WHERE host = hosts.name
+				UNION
+				SELECT principal FROM host_labels
+				JOIN prestash_labels
+				    ON prestash_labels.target =
+				       'label:' || host_labels.label
+				WHERE host_labels.host = hosts.name))
+			    > } . MAX_TIX_PER_HOST;
+
+		my $sth = sql_uncached($dbh, $stmt, @$chunk);
+		my $over = $sth->fetchall_arrayref();
+
+		if (@$over) {
+			$dbh->rollback();
+			die [500, 'limit exceeded: you can only prestash ' .
+			    MAX_TIX_PER_HOST . ' tickets on a single host ' .
+			    'or service address'];
+		}
 	}
 
 	$dbh->commit();
@@ -1397,52 +2605,140 @@ sub query_ticket {
 
 	$query{expand} = 1 if $query{verbose};
 
-	my @where;
-	my @bindv;
+	#
+	# The list of principals for an expanded host, which is what
+	# fetch_tickets() asks for, comes straight out of prestash_expanded.
+	# The second half of the UNION finds the tickets prestashed on the
+	# labels of the host and of the logical hosts which map onto it,
+	# which are in prestash_expanded as label:LABEL, using the same
+	# index.  As the labels of a host may change after the ticket was
+	# prestashed, the realm of the host is checked against the realm
+	# of the principal here rather than by insert_ticket().
+
+	if (exists($query{host}) && $query{expand} && !$query{verbose} &&
+	    !exists($query{principal})) {
+		my $realm = '';
+		my @rbind;
+
+		if (exists($query{realm})) {
+			$realm = "AND realm = ?";
+			@rbind = ($query{realm});
+		}
 
-	if (exists($query{host})) {
-		my $tmp  = "target = ?";
-		   $tmp .= " OR configured = ?"	if $query{expand};
-		push(@where, $tmp);
-		push(@bindv, $query{host});
-		push(@bindv, $query{host})	if $query{expand};
+		my $stmt = qq{
+			SELECT principal, realm, 0, NULL FROM prestash_expanded
+			WHERE target = ? $realm
+			UNION
+			SELECT principal, realm, 1,
+			    (SELECT realm FROM hosts WHERE name = ?)
+			FROM prestash_expanded
+			WHERE target IN (
+				SELECT 'label:' || label FROM host_labels
+				WHERE host = ?
+				UNION
+				SELECT 'label:' || host_labels.label
+				FROM hostmap_closure
+				JOIN host_labels
+				    ON host_labels.host =
+				       hostmap_closure.logical
+				WHERE hostmap_closure.physical = ?
+			) $realm
+		};
+		my @bindv = ($query{host}, @rbind, ($query{host}) x 3, @rbind);
+
+		my $sth = sql_cached($dbh, $stmt, @bindv);
+
+		my %seen;
+		my @ret;
+		for my $row (@{$sth->fetchall_arrayref()}) {
+			my ($princ, $prealm, $labelled, $hrealm) = @$row;
+
+			next if $seen{$princ};
+			next if $labelled && (!defined($prealm) ||
+			    !defined($hrealm) || !$self->{policy}->
+			    prestash_realms($prealm)->{$hrealm});
+
+			$seen{$princ} = 1;
+			push(@ret, $princ);
+		}
+
+		return \@ret;
 	}
 
+	my @where;
+	my @bindv;
+
 	if (exists($query{principal})) {
-		push(@where, "principal = ?");
+		push(@where, "prestashed.principal = ?");
 		push(@bindv, $query{principal});
 	}
 
 	if (exists($query{realm})) {
-		if ($query{realm} =~ /\@_%/) {
-			die [503, "Invalid character in supplied realm."];
-		}
-
-		push(@where, "principal LIKE ?");
-		push(@bindv, '%@' . $query{realm});
+		push(@where, "prestashed.realm = ?");
+		push(@bindv, $query{realm});
 	}
 
-	my $where = join( ' AND ', @where );
-	$where = "WHERE $where" if length($where) > 0;
+	#
+	# Label targets are listed as they were configured alongside the
+	# hosts, they are not expanded.
 
-	my $fields = "principal, host AS target";
-	my $from   = "prestashed";
+	my $fields = "prestashed.principal AS principal, " .
+		     "prestashed.host AS target";
+	my $from   = qq{(
+		SELECT principal, host, realm FROM prestashed
+		UNION ALL
+		SELECT principal, target, realm FROM prestash_labels
+	) AS prestashed};
 
 	if ($query{expand}) {
 		$from .= qq{
-			LEFT JOIN hostmap ON prestashed.host = hostmap.logical
+			LEFT JOIN hostmap_closure
+			    ON prestashed.host = hostmap_closure.logical
 		};
 
 		$fields = qq{
-			prestashed.principal	AS principal,
-			prestashed.host		AS configured,
-			hostmap.physical	AS target
+			prestashed.principal		AS principal,
+			prestashed.host			AS configured,
+			hostmap_closure.physical	AS target
 		};
 	}
 
-	my $stmt = "SELECT $fields FROM $from $where";
+	my $stmt;
+	if (exists($query{host}) && $query{expand}) {
+		#
+		# When expanding, a host matches either as the configured
+		# host or as a host reachable through the hostmap.  We express
+		# this as a UNION ALL of two disjoint queries so that each
+		# half is driven by an index rather than an OR across the
+		# join which SQLite would satisfy with a full scan.
+
+		my $where = join('', map { " AND $_" } @where);
+
+		$stmt = qq{
+			SELECT $fields FROM $from
+			WHERE prestashed.host = ? $where
+			UNION ALL
+			SELECT $fields FROM hostmap_closure
+			JOIN prestashed
+			    ON prestashed.host = hostmap_closure.logical
+			WHERE hostmap_closure.physical = ?
+			  AND prestashed.host != ? $where
+		};
+		@bindv = ($query{host}, @bindv, $query{host}, $query{host},
+		    @bindv);
+	} else {
+		if (exists($query{host})) {
+			unshift(@where, "prestashed.host = ?");
+			unshift(@bindv, $query{host});
+		}
+
+		my $where = join( ' AND ', @where );
+		$where = "WHERE $where" if length($where) > 0;
 
-	my $sth = sql_command($dbh, $stmt, @bindv);
+		$stmt = "SELECT $fields FROM $from $where";
+	}
+
+	my $sth = sql_cached($dbh, $stmt, @bindv);
 
 	#
 	# We now reformat the result to be comprised of the simplest
@@ -1500,8 +2796,139 @@ sub query_ticket {
 	return [keys %ret];
 }
 
+#
+# Principals which have been flagged with share_ticket() have the
+# tickets that we mint for them cached in memory, keyed on the logical
+# host through which they reach the target, for ticket_share seconds.
+# The hosts of a cluster which fetch in the same interval then all get
+# the same credential rather than each causing a new ticket to be
+# minted.  The cache only ever holds the tickets of a single interval.
+
+our %ticket_cache = (bucket => -1, tix => {}, bytes => 0);
+our %ticket_cache_stats = (hits => 0, misses => 0);
+
+sub share_ticket {
+	my ($self, $princ, $share) = @_;
+	my $usage = "share_ticket <princ> <0|1>";
+	my $ctx = $self->{ctx};
+	my $dbh = $self->{dbh};
+
+	require_fqprinc($ctx, $usage, 1, $princ);
+	require_scalar($usage, 2, $share);
+
+	$self->check_acl('share_ticket', $princ);
+
+	if ($share) {
+		sql_cached($dbh, qq{
+			INSERT OR IGNORE INTO prestash_shared (principal)
+			VALUES (?)
+		}, $princ);
+	} else {
+		sql_cached($dbh, "DELETE FROM prestash_shared " .
+		    "WHERE principal = ?", $princ);
+	}
+
+	$dbh->commit();
+
+	return undef;
+}
+
+#
+# shared_tickets() returns a hash mapping each of the shared principals
+# prestashed on $host through a logical host to that logical host.  If
+# a principal reaches $host through more than one logical host then we
+# choose the least so that all of the hosts make the same choice.
+
+sub shared_tickets {
+	my ($self, $host, $realm) = @_;
+	my $dbh = $self->{dbh};
+
+	return {} if !$self->{ticket_share};
+
+	my $stmt = qq{
+		SELECT prestash_expanded.principal,
+		       MIN(prestash_expanded.configured)
+		FROM prestash_expanded
+		JOIN prestash_shared
+		    ON prestash_expanded.principal = prestash_shared.principal
+		WHERE prestash_expanded.target = ?
+		  AND prestash_expanded.configured != prestash_expanded.target
+	};
+	my @bindv = ($host);
+
+	if (defined($realm)) {
+		$stmt .= " AND prestash_expanded.realm = ?";
+		push(@bindv, $realm);
+	}
+
+	$stmt .= " GROUP BY prestash_expanded.principal";
+
+	my $sth = sql_cached($dbh, $stmt, @bindv);
+
+	return { map { $_->[0] => $_->[1] } @{$sth->fetchall_arrayref()} };
+}
+
+sub mint_prestashed {
+	my ($self, $princ, $logical) = @_;
+	my $interval = $self->{ticket_share};
+
+	if (!defined($logical) || !$interval) {
+		return Krb5Admin::C::mint_ticket($self->{ctx}, $self->{hndl},
+		    $princ, PRESTASH_LIFETIME, 0);
+	}
+
+	my $bucket = int(time() / $interval);
+	my $dbname = defined($self->{dbname}) ? $self->{dbname} : '';
+	my $key = join($;, $dbname, $princ, $logical);
+
+	if ($ticket_cache{bucket} != $bucket ||
+	    keys %{$ticket_cache{tix}} >= TICKET_CACHE_MAX) {
+		%ticket_cache = (bucket => $bucket, tix => {}, bytes => 0);
+	}
+
+	my $creds = $ticket_cache{tix}->{$key};
+	if (defined($creds)) {
+		$ticket_cache_stats{hits}++;
+		return $creds;
+	}
+
+	$ticket_cache_stats{misses}++;
+	$creds = Krb5Admin::C::mint_ticket($self->{ctx}, $self->{hndl},
+	    $princ, PRESTASH_LIFETIME, 0);
+
+	$ticket_cache{tix}->{$key} = $creds;
+	$ticket_cache{bytes} += length($key) + length($creds->{client}) +
+	    length($creds->{server}) + length($creds->{ticket}) +
+	    length($creds->{keyblock}->{key});
+
+	return $creds;
+}
+
+sub ticket_cache_stats {
+	my ($self) = @_;
+	my $lookups = $ticket_cache_stats{hits} + $ticket_cache_stats{misses};
+
+	return {
+		%ticket_cache_stats,
+		hit_rate	=> $lookups ?
+		    $ticket_cache_stats{hits} / $lookups : 0,
+		entries		=> scalar(keys %{$ticket_cache{tix}}),
+		bytes		=> $ticket_cache{bytes},
+	};
+}
+
+#
+# fetch_tickets() may be passed the client's STATE, a hash reference
+# mapping each principal for which the host currently has a ticket to
+# the ticket's endtime.  If it is, we only mint the tickets which are
+# missing or which expire within prestash_renew seconds and we tell the
+# client which of its tickets are no longer configured.  As most hosts
+# fetch far more often than their tickets expire, this saves us from
+# minting and shipping tickets that the client already has.  Without
+# STATE, every ticket is minted and returned as before.
+
 sub fetch_tickets {
-	my ($self, $realm, $host) = @_;
+	my ($self, $realm, $host, $state) = @_;
 	my $ctx = $self->{ctx};
 	my $hndl = $self->{hndl};
 
@@ -1510,7 +2937,7 @@ sub fetch_tickets {
 	}
 
 	if (!defined($host)) {
-		my @sprinc = Krb5Admin::C::krb5_parse_name($ctx,
+		my @sprinc = Krb5Admin::C::parse_name($ctx,
 		    $self->{client});
 
 		if ($sprinc[1] eq 'host') {
@@ -1519,15 +2946,45 @@ sub fetch_tickets {
 	}
 
 	$self->check_acl('fetch_tickets', $host);
+	my $token = $self->admit('fetch_tickets', $realm, $host);
 
 	my $tix = $self->query_ticket(host => $host, realm => $realm,
 	    expand => 1);
+	my $shared = $self->shared_tickets($host, $realm);
+
+	if (!defined($state)) {
+		return { map {
+			$_ => $self->mint_prestashed($_, $shared->{$_});
+		} @$tix };
+	}
+
+	require_hashref("fetch_tickets <realm> <host> {state}", 3, $state);
+
+	if (keys %$state > MAX_TIX_PER_HOST) {
+		die [500, 'limit exceeded: the state may contain no more ' .
+			  'than ' . MAX_TIX_PER_HOST . ' tickets'];
+	}
 
-	# XXXrcd: make configurable...
-	return { map {
-		$_ => Krb5Admin::C::mint_ticket($ctx, $hndl, $_, 7 * 3600 * 24,
-		    0);
-	} @$tix };
+	#
+	# An endtime which is malformed or further away than we would ever
+	# have issued is treated as missing.
+
+	my $now = time();
+	my %configured = map { $_ => 1 } @$tix;
+	my @mint = grep {
+		my $end = $state->{$_};
+
+		!defined($end) || $end !~ /^\d+$/ ||
+		$end < $now + $self->{prestash_renew} ||
+		$end > $now + PRESTASH_LIFETIME;
+	} @$tix;
+
+	return {
+		tickets	=> { map {
+			$_ => $self->mint_prestashed($_, $shared->{$_});
+		} @mint },
+		remove	=> [ grep { !$configured{$_} } keys %$state ],
+	};
 }
 
 sub remove_ticket {
@@ -1549,17 +3006,23 @@ sub remove_ticket {
 
 	$self->check_acl('remove_ticket', $princ, @hosts);
 
-	while (@hosts) {
-		my @curhosts = splice(@hosts, 0, 500);
+	for my $chunk (sql_chunks(1, 1, @hosts)) {
+		my $in = join(',', map { '?' } @$chunk);
 
-		sql_command($dbh, qq{
-			DELETE FROM prestashed WHERE principal = ? AND (
-		    } . join(' OR ', map {"host=?"} @curhosts) . qq{
-			)
-		    }, $princ, @curhosts);
+		sql_uncached($dbh, qq{
+			DELETE FROM prestashed
+			WHERE principal = ? AND host IN ($in)
+		}, $princ, @$chunk);
 
-		#
-		# XXXrcd: error handling and all that.
+		sql_uncached($dbh, qq{
+			DELETE FROM prestash_labels
+			WHERE principal = ? AND target IN ($in)
+		}, $princ, @$chunk);
+
+		sql_uncached($dbh, qq{
+			DELETE FROM prestash_expanded
+			WHERE principal = ? AND configured IN ($in)
+		}, $princ, @$chunk);
 	}
 
 	$dbh->commit();
@@ -1567,6 +3030,248 @@ sub remove_ticket {
 	return undef;
 }
 
+#
+# The tables that are carried in a snapshot.  hostmap_closure and
+# prestash_expanded are derived from these and so are not exported.
+
+our @snapshot_tables = (
+	[hosts			=> qw/name realm ip_addr bootbinding/],
+	[host_labels		=> qw/host label/],
+	[hostmap		=> qw/logical physical/],
+	[prestashed		=> qw/principal host realm/],
+	[prestash_labels	=> qw/principal target realm/],
+	[prestash_shared	=> qw/principal/],
+);
+
+#
+# export_snapshot() writes the whole of the KDB and of the SQL tables
+# to $path in the format described in Krb5Admin::Snapshot.  SQLite is
+# in WAL mode and so the first read of a deferred transaction fixes the
+# view of the SQL tables that we see until we roll back without blocking
+# the writers.  DBD::SQLite begins its implicit transactions with BEGIN
+# IMMEDIATE, which takes the write lock, and so we turn that off for the
+# duration of the export.  We take the view before export_kdb() walks
+# the KDB under its read lock.  The principals and rows are streamed to
+# the file one at a time so our memory use does not depend on the size
+# of the realm.
+
+sub export_snapshot {
+	my ($self, $path) = @_;
+	my $dbh = $self->{dbh};
+	my %counts;
+
+	require_scalar("export_snapshot <path>", 1, $path);
+
+	$self->check_acl('export_snapshot');
+
+	$dbh->rollback();
+	local $dbh->{sqlite_use_immediate_transaction} = 0;
+
+	my $snap = Krb5Admin::Snapshot->create($path, 'meta', 'principals',
+	    map { $_->[0] } @snapshot_tables);
+
+	eval {
+		#
+		# This read fixes our view of the SQL tables.
+
+		$dbh->selectrow_array("SELECT COUNT(*) FROM hosts");
+		my ($version) = $dbh->selectrow_array("PRAGMA user_version");
+
+		$snap->begin('meta');
+		$snap->row(qw/key value/);
+		$snap->row(schema => $version);
+		$snap->row(time => time());
+		$snap->end();
+
+		$snap->begin('principals');
+		$counts{principals} = Krb5Admin::C::export_kdb($self->{ctx},
+		    $self->{hndl}, $snap->fileno());
+		$snap->end($counts{principals});
+
+		for my $table (@snapshot_tables) {
+			my ($name, @cols) = @$table;
+			my $sth = sql_cached($dbh, "SELECT " .
+			    join(', ', @cols) . " FROM $name");
+
+			$counts{$name} = 0;
+			$snap->begin($name);
+			$snap->row(@cols);
+			while (my $row = $sth->fetchrow_arrayref()) {
+				$snap->row(@$row);
+				$counts{$name}++;
+			}
+			$snap->end();
+		}
+
+		$snap->close();
+	};
+	my $err = $@;
+
+	$dbh->rollback();
+
+	if ($err) {
+		die $err		if ref($err);
+		die [500, "export_snapshot: $err"];
+	}
+
+	return \%counts;
+}
+
+#
+# import_snapshot() replaces the KDB and the SQL tables with the contents
+# of a snapshot written by export_snapshot().  The KDB cannot be rolled
+# back and so we do not touch it until we know that the rest will work:
+# we first check that the principals section holds as many records as
+# the index says and then replace the SQL tables in a transaction which
+# we only commit once the principals are in.  To replace the tables, we
+# drop the secondary indexes, empty the tables, load the rows with
+# multi-row INSERTs IMPORT_BATCH rows at a time, build the indexes once
+# all of the rows are in and finally derive hostmap_closure and
+# prestash_expanded.  Columns in the snapshot that we do not know are
+# ignored and those that it lacks are loaded as NULL.  The principals
+# are then stored by import_kdb() straight out of the mmap(2)ed file
+# under a single write lock on the KDB which is only synced once at the
+# end.  If that fails part of the way through, the SQL tables are left
+# as they were but the KDB may hold some of the snapshot's principals.
+
+sub _import_table {
+	my ($dbh, $snap, $table) = @_;
+	my ($name, @cols) = @$table;
+	my %pos;
+	my @rows;
+	my $count = 0;
+
+	my @have = $snap->columns($name);
+	@pos{@have} = (0 .. $#have);
+	my @map = map { $pos{$_} } @cols;
+
+	$snap->rows($name, sub {
+		my ($row) = @_;
+
+		push(@rows, [map { defined($_) ? $row->[$_] : undef } @map]);
+		$count++;
+
+		if (@rows >= IMPORT_BATCH) {
+			sql_bulk_insert($dbh, $name, \@cols, @rows);
+			@rows = ();
+		}
+	});
+
+	sql_bulk_insert($dbh, $name, \@cols, @rows);
+	return $count;
+}
+
+sub import_snapshot {
+	my ($self, $path) = @_;
+	my $dbh = $self->{dbh};
+	my %counts;
+
+	require_scalar("import_snapshot <path>", 1, $path);
+
+	$self->check_acl('import_snapshot');
+
+	my $snap = eval { Krb5Admin::Snapshot->open($path) };
+	die [503, "import_snapshot: $@"]	if $@;
+
+	my %meta;
+	my %have = map { $_ => 1 } $snap->sections();
+	eval {
+		$snap->rows('meta', sub { $meta{$_[0]->[0]} = $_[0]->[1] });
+	};
+
+	if (!defined($meta{schema}) || !$have{principals} ||
+	    $meta{schema} > @schema_upgrades) {
+		die [503, "import_snapshot: $path is not a snapshot that " .
+		    "we can load"];
+	}
+
+	my ($off, $len, $count) = $snap->section('principals');
+	my $records = 0;
+
+	eval { $snap->records('principals', sub { $records++ }) };
+	if ($@ || $records != $count) {
+		die [503, "import_snapshot: $path has $records of its " .
+		    "$count principals"];
+	}
+
+	my $kdb_touched = 0;
+	eval {
+		my $indexes = $dbh->selectall_arrayref(qq{
+			SELECT name, sql FROM sqlite_master
+			WHERE type = 'index' AND sql IS NOT NULL
+		});
+
+		$dbh->do("PRAGMA defer_foreign_keys = ON");
+		$dbh->do("DROP INDEX $_->[0]")	for @$indexes;
+
+		for my $name (qw/prestash_expanded hostmap_closure/,
+		    reverse(map { $_->[0] } @snapshot_tables)) {
+			$dbh->do("DELETE FROM $name");
+		}
+
+		for my $table (@snapshot_tables) {
+			$counts{$table->[0]} = 0;
+			next if !$have{$table->[0]};
+
+			$counts{$table->[0]} = _import_table($dbh, $snap, $table);
+		}
+
+		$dbh->do($_->[1])		for @$indexes;
+
+		my $edges = $dbh->selectall_arrayref(qq{
+			SELECT logical, physical FROM hostmap
+		});
+
+		for my $edge (@$edges) {
+			next if _hostmap_loops($dbh, @$edge);
+			_hostmap_closure_edge($dbh, @$edge, 1);
+		}
+
+		$dbh->do(qq{
+			INSERT INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT host, realm, principal, host FROM prestashed
+			UNION ALL
+			SELECT target, realm, principal, target
+			FROM prestash_labels
+		});
+
+		$dbh->do(qq{
+			INSERT OR IGNORE INTO prestash_expanded
+			    (target, realm, principal, configured)
+			SELECT hostmap_closure.physical, prestashed.realm,
+			       prestashed.principal, prestashed.host
+			FROM prestashed
+			JOIN hostmap_closure
+			    ON prestashed.host = hostmap_closure.logical
+		});
+
+		delete $query_cache{defined($self->{dbname}) ?
+		    $self->{dbname} : ''};
+		$kdb_touched = 1;
+		$counts{principals} = Krb5Admin::C::import_kdb($self->{ctx},
+		    $self->{hndl}, $path, $off, $len);
+
+		if ($counts{principals} != $count) {
+			die [500, "import_snapshot: loaded " .
+			    "$counts{principals} of $count principals"];
+		}
+
+		$dbh->commit();
+	};
+
+	if (my $err = $@) {
+		$dbh->rollback();
+		$self->kdb_changed()	if $kdb_touched;
+		die $err		if ref($err);
+		die [500, "import_snapshot: $err"];
+	}
+
+	$self->kdb_changed();
+
+	return \%counts;
+}
+
 1;
 
 __END__
@@ -1635,6 +3340,31 @@ the Windows cross realm bootstrapping table.  Must be a hash reference.
 
 the prestashed cross realm authorisation table.  Must be a hash reference.
 
+=item rdns_cache
+
+a directory in which to cache the reverse DNS lookups of client
+addresses so that they are shared between processes.  If not supplied,
+lookups are only cached in memory.
+
+=item prestash_renew
+
+the number of seconds before a prestashed ticket expires within which
+B<fetch_tickets> will replace it when the client supplies its state.
+The default is two days.
+
+=item ticket_share
+
+the number of seconds for which the tickets minted by B<fetch_tickets>
+for principals flagged with B<share_ticket> are shared by the hosts
+that a logical host maps onto.  The default is 300 and 0 disables the
+sharing.
+
+=item scheduler
+
+a Krb5Admin::Scheduler which is used to limit the number of expensive
+calls, such as B<fetch_tickets>, B<create_bootstrap_id> and wildcard
+B<mquery>, that run at once.  If not supplied, no limit is applied.
+
 =back
 
 =back
@@ -1644,6 +3374,66 @@ the prestashed cross realm authorisation table.  Must be a hash reference.
 All of the user-visible methods are inherited from Krb5Admin and are
 documented there as well.
 
+=over 4
+
+=item rebind(client => CLIENT, addr => ADDR)
+
+returns an object for a new connexion from CLIENT at ADDR which shares
+the Kerberos context and SQLite handle of an existing object.  Any
+uncommitted SQL changes are rolled back, as they are again when the
+returned object is destroyed.  No other state is carried over from
+the previous connexion.  This is not exported over the wire.
+
+=item export_snapshot(PATH)
+
+writes a consistent copy of the Kerberos DB and of the SQL tables to
+PATH in the format described in L<Krb5Admin::Snapshot>.  The keys of
+the principals remain encrypted in the master key.  A hash reference
+of the number of principals and rows in each table is returned.  This
+is only implemented for Heimdal and is not exported over the wire.
+
+=item import_snapshot(PATH)
+
+replaces the principals in the Kerberos DB and all of the SQL tables
+with the contents of a snapshot written by B<export_snapshot>.  The
+snapshot's master key must be the same as ours.  The principals are
+stored directly in the database under a single write lock and so the
+load is not recorded in the kadm5 log and is not propagated by iprop.
+Principals that are not in the snapshot are left alone.  The SQL
+tables are only replaced if all of the principals are loaded, and a
+snapshot whose principals do not match its index is refused before
+anything is changed.  A hash reference of the number of principals and
+rows loaded is returned.
+This is only implemented for Heimdal and is not exported over the
+wire.
+
+=item scheduler_stats()
+
+returns the statistics of the object's Krb5Admin::Scheduler, if it was
+given one, as described in L<Krb5Admin::Scheduler>.  This is not
+exported over the wire.
+
+=item ticket_cache_stats()
+
+returns a hash reference containing the B<hits>, B<misses> and
+B<hit_rate> of the per process cache of shared prestashed tickets,
+the number of tickets that it holds (B<entries>) and the approximate
+number of bytes that they occupy (B<bytes>).  krb5_admind logs these
+periodically.  This is not exported over the wire.
+
+=item query_cache_stats()
+
+returns a hash reference containing the number of B<hits> and
+B<misses> of the per process cache of the principal metadata returned
+by B<query> and B<mquery>, the number of times that it was flushed
+because another process modified the KDB or the kadm5 log
+(B<flushes>) and the number
+of principals that it currently holds (B<entries>).  The cache never
+holds key material.  krb5_admind logs these periodically.  This is not
+exported over the wire.
+
+=back
+
 =head1 SEE ALSO
 
 L<Krb5Admin>
@@ -0,0 +1,139 @@
+#
+# Blame: "Roland C. Dowdeswell" <elric@imrryr.org>
+
+package Krb5Admin::Policy;
+
+use Kharon::Entitlement::ACLFile;
+use Kharon::Entitlement::Equals;
+
+use strict;
+use warnings;
+
+#
+# A Krb5Admin::Policy is the compiled form of the ACL file and of the
+# cross realm tables from krb5_admind's configuration.  The tables are
+# turned into hash sets so that each check is a hash probe and the ACL
+# decisions are remembered per client and verb.  Policies are shared
+# by all of the connexions in a process through get() which only builds
+# a new one if the ACL file has changed, as judged by its mtime, size
+# and inode, or if the tables are different.
+
+our %policies;
+
+sub table_sig {
+	my ($table) = @_;
+
+	return '' if ref($table) ne 'HASH';
+	return join($;, map {
+		my $v = $table->{$_};
+		($_, ref($v) eq 'ARRAY' ? join(',', @$v) : '');
+	} sort keys %$table);
+}
+
+sub file_sig {
+	my ($file) = @_;
+	my @st = stat($file);
+
+	return '' if !@st;
+	return join(':', @st[9,7,1]);
+}
+
+sub get {
+	my ($class, %args) = @_;
+
+	my $key = join($;, $args{acl_file}, map { table_sig($args{$_}) }
+	    qw/xrealm_bootstrap win_xrealm_bootstrap prestash_xrealm/);
+	my $sig = file_sig($args{acl_file});
+
+	my $policy = $policies{$key};
+	if (!defined($policy) || $policy->{sig} ne $sig) {
+		$policy = $class->new(%args);
+		$policy->{sig} = $sig;
+		$policies{$key} = $policy;
+	}
+
+	return $policy;
+}
+
+sub set_of {
+	my ($table) = @_;
+	my %set;
+
+	return \%set if ref($table) ne 'HASH';
+
+	for my $k (keys %$table) {
+		next if ref($table->{$k}) ne 'ARRAY';
+		$set{$k} = { map { $_ => 1 } @{$table->{$k}} };
+	}
+
+	return \%set;
+}
+
+sub new {
+	my ($proto, %args) = @_;
+	my $class = ref($proto) || $proto;
+	my %self;
+
+	my $subacls = Kharon::Entitlement::Equals->new();
+
+	$self{acl} = Kharon::Entitlement::ACLFile->new(
+	    filename => $args{acl_file}, subobject => $subacls);
+
+	$self{decisions}	= {};
+	$self{xrealm}		= set_of($args{xrealm_bootstrap});
+	$self{win_xrealm}	= set_of($args{win_xrealm_bootstrap});
+	$self{prestash}		= set_of($args{prestash_xrealm});
+
+	bless(\%self, $class);
+}
+
+#
+# check() returns true if the ACL file grants $verb to $client.
+
+sub check {
+	my ($self, $client, $verb) = @_;
+	my $key = join($;, defined($client) ? "+$client" : '-', $verb);
+
+	if (!exists($self->{decisions}->{$key})) {
+		$self->{decisions} = {}	if keys %{$self->{decisions}} > 10000;
+		$self->{acl}->set_creds($client);
+		$self->{decisions}->{$key} = $self->{acl}->check($verb) ? 1 : 0;
+	}
+
+	return $self->{decisions}->{$key};
+}
+
+#
+# xrealm_bootstrap() returns true if host principals in $srealm may
+# bootstrap the same host's principal in $prealm.
+
+sub xrealm_bootstrap {
+	my ($self, $srealm, $prealm) = @_;
+
+	return exists($self->{xrealm}->{$srealm}) &&
+	    exists($self->{xrealm}->{$srealm}->{$prealm});
+}
+
+#
+# win_xrealm_bootstrap() returns true if the (lower cased) Windows
+# principal $sprinc may bootstrap $pprinc.
+
+sub win_xrealm_bootstrap {
+	my ($self, $sprinc, $pprinc) = @_;
+
+	return exists($self->{win_xrealm}->{$sprinc}) &&
+	    exists($self->{win_xrealm}->{$sprinc}->{$pprinc});
+}
+
+#
+# prestash_realms() returns a hash set of the realms of the hosts on
+# which principals in $prealm may be prestashed.  Unless configured
+# otherwise, this is just $prealm.
+
+sub prestash_realms {
+	my ($self, $prealm) = @_;
+
+	return $self->{prestash}->{$prealm} || { $prealm => 1 };
+}
+
+1;
@@ -0,0 +1,278 @@
+#
+# Blame: "Roland C. Dowdeswell" <elric@imrryr.org>
+
+package Krb5Admin::Scheduler;
+
+use Fcntl qw/:flock O_RDWR O_CREAT/;
+use IO::File;
+use Sys::Syslog;
+use Time::HiRes qw/sleep time/;
+
+use strict;
+use warnings;
+
+use constant {
+	SCHED_DIR		=> '/var/run/krb5_admind',
+	SCHED_SLOTS		=> 4,
+	SCHED_TIMEOUT		=> 60,
+	SCHED_POLL		=> 0.025,
+};
+
+#
+# A Krb5Admin::Scheduler provides admission control for the RPCs which
+# are expensive to serve.  krb5_admind runs as a number of processes
+# each of which serves one connexion at a time, so the state has to be
+# shared through the file system.  There are a fixed number of slot
+# files in the scheduler's directory and an expensive call must hold an
+# exclusive lock on one of them while it runs.  Calls that are waiting
+# for a slot leave a marker file in the directory which is how we count
+# the depth of the queue.  Cheap calls are never queued and so they are
+# not delayed by a storm of expensive ones.
+#
+# Verbs are classified by %cost.  A verb may have a sub rather than a
+# class if its cost depends upon its arguments.
+
+our %cost = (
+	fetch_tickets		=> 'expensive',
+	create_bootstrap_id	=> 'expensive',
+	mquery			=> sub {
+		my (@args) = @_;
+
+		return 'expensive' if @args == 0;
+		return 'expensive' if grep { !defined($_) || /[*?\[]/ } @args;
+		return 'cheap';
+	},
+);
+
+sub new {
+	my ($proto, %args) = @_;
+	my $class = ref($proto) || $proto;
+
+	my $self = {
+		dir	=> SCHED_DIR,
+		slots	=> SCHED_SLOTS,
+		timeout	=> SCHED_TIMEOUT,
+		held	=> undef,
+		stats	=> {
+			admitted	=> 0,
+			rejected	=> 0,
+			waited		=> 0,
+			wait_total	=> 0,
+			wait_max	=> 0,
+		},
+	};
+
+	for my $k (qw/dir slots timeout/) {
+		$self->{$k} = $args{$k}		if defined($args{$k});
+	}
+
+	if (! -d $self->{dir} && !mkdir($self->{dir}, 0700) &&
+	    ! -d $self->{dir}) {
+		die "Could not create scheduler directory $self->{dir}: $!\n";
+	}
+
+	bless($self, $class);
+}
+
+sub classify {
+	my ($verb, @args) = @_;
+	my $class = $cost{$verb};
+
+	return 'cheap'			if !defined($class);
+	return $class->(@args)		if ref($class) eq 'CODE';
+	return $class;
+}
+
+#
+# queue_depth() counts the markers of the calls which are waiting for a
+# slot.  Markers left behind by processes that have died are removed.
+
+sub queue_depth {
+	my ($self) = @_;
+	my $depth = 0;
+
+	opendir(my $d, $self->{dir}) or return 0;
+	for my $f (readdir($d)) {
+		next if $f !~ /^queue\.(\d+)$/;
+
+		if ($1 != $$ && !kill(0, $1) && $!{ESRCH}) {
+			unlink("$self->{dir}/$f");
+			next;
+		}
+		$depth++;
+	}
+	closedir($d);
+
+	return $depth;
+}
+
+sub try_slot {
+	my ($self) = @_;
+
+	for my $i (0 .. $self->{slots} - 1) {
+		my $fh = IO::File->new("$self->{dir}/slot.$i", O_RDWR|O_CREAT,
+		    0600);
+
+		next if !defined($fh);
+		return $fh if flock($fh, LOCK_EX|LOCK_NB);
+		close($fh);
+	}
+
+	return undef;
+}
+
+#
+# admit() returns a token which must be held for the duration of the
+# call.  The slot is released when the token goes out of scope.  Cheap
+# calls, and calls made while we already hold a slot, get an empty
+# token so that a method which calls another expensive method cannot
+# deadlock against itself.  If we cannot get a slot within the timeout
+# then we fail the call rather than letting the queue grow without
+# bound.
+
+sub admit {
+	my ($self, $verb, @args) = @_;
+	my $stats = $self->{stats};
+
+	if (defined($self->{held}) || classify($verb, @args) ne 'expensive') {
+		return Krb5Admin::Scheduler::Token->new();
+	}
+
+	my $start = time();
+	my $fh = $self->try_slot();
+	my $depth = 0;
+
+	if (!defined($fh)) {
+		my $marker = "$self->{dir}/queue.$$";
+		my $m = IO::File->new($marker, O_RDWR|O_CREAT, 0600);
+		close($m)			if defined($m);
+
+		$depth = $self->queue_depth();
+		while (!defined($fh = $self->try_slot())) {
+			last if time() - $start > $self->{timeout};
+			sleep(SCHED_POLL);
+		}
+
+		unlink($marker);
+	}
+
+	my $wait = time() - $start;
+
+	if (!defined($fh)) {
+		$stats->{rejected}++;
+		syslog('err', "%s", sprintf("scheduler rejected %s after " .
+		    "%.3fs with %d queued", $verb, $wait, $depth));
+		die [500, "Server busy: too many expensive requests are " .
+		    "running, try again later"];
+	}
+
+	$stats->{admitted}++;
+	$stats->{wait_total} += $wait;
+	$stats->{wait_max} = $wait	if $wait > $stats->{wait_max};
+
+	if ($depth > 0) {
+		$stats->{waited}++;
+		syslog('info', "%s", sprintf("scheduler admitted %s after " .
+		    "%.3fs with %d queued", $verb, $wait, $depth));
+	}
+
+	$self->{held} = $verb;
+	return Krb5Admin::Scheduler::Token->new($self, $fh);
+}
+
+sub release {
+	my ($self, $fh) = @_;
+
+	flock($fh, LOCK_UN);
+	close($fh);
+	$self->{held} = undef;
+}
+
+sub stats {
+	my ($self) = @_;
+	my $stats = $self->{stats};
+
+	return {
+		%$stats,
+		wait_avg	=> $stats->{admitted} ?
+		    $stats->{wait_total} / $stats->{admitted} : 0,
+		queue_depth	=> $self->queue_depth(),
+		slots		=> $self->{slots},
+	};
+}
+
+package Krb5Admin::Scheduler::Token;
+
+sub new {
+	my ($class, $sched, $fh) = @_;
+
+	bless({ sched => $sched, fh => $fh }, $class);
+}
+
+sub DESTROY {
+	my ($self) = @_;
+
+	$self->{sched}->release($self->{fh})	if defined($self->{fh});
+}
+
+1;
+
+__END__
+
+=head1 NAME
+
+Krb5Admin::Scheduler - admission control for expensive krb5_admind RPCs
+
+=head1 SYNOPSIS
+
+	use Krb5Admin::Scheduler;
+
+	my $sched = Krb5Admin::Scheduler->new(dir => '/var/run/krb5_admind');
+	my $token = $sched->admit('fetch_tickets', @args);
+
+=head1 DESCRIPTION
+
+Krb5Admin::Scheduler limits the number of expensive RPCs that are run
+at once across all of the processes of krb5_admind that share its
+directory.  Cheap RPCs are never delayed.
+
+=head1 CONSTRUCTOR
+
+=over 4
+
+=item new(ARGS)
+
+creates a new scheduler.  ARGS is a hash which may contain B<dir>, the
+directory in which the slot and queue files are kept (default
+/var/run/krb5_admind), B<slots>, the number of expensive calls which
+may run at once (default 4) and B<timeout>, the number of seconds that
+an expensive call will wait for a slot before it fails (default 60).
+
+=back
+
+=head1 METHODS
+
+=over 4
+
+=item admit(VERB, ARGS)
+
+classifies the call and, if it is expensive, waits for a slot.  It
+returns a token which holds the slot until it is destroyed.
+
+=item queue_depth()
+
+returns the number of calls which are currently waiting for a slot.
+
+=item stats()
+
+returns a hash reference containing the number of calls that were
+B<admitted>, B<rejected> and that B<waited> in this process, the total,
+average and maximum wait time in seconds (B<wait_total>, B<wait_avg>
+and B<wait_max>), the current B<queue_depth> and the number of
+B<slots>.
+
+=back
+
+=head1 SEE ALSO
+
+L<Krb5Admin::KerberosDB>, L<krb5_admind(8)>
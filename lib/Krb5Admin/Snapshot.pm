@@ -0,0 +1,434 @@
+#
+# Blame: "Roland C. Dowdeswell" <elric@imrryr.org>
+
+package Krb5Admin::Snapshot;
+
+use Fcntl qw/O_WRONLY O_CREAT O_EXCL SEEK_SET SEEK_CUR/;
+use IO::File;
+
+use strict;
+use warnings;
+
+use constant {
+	MAGIC		=> 'KRB5ADMS',
+	VERSION		=> 1,
+	HDR_SIZE	=> 16,
+	IDX_SIZE	=> 40,
+	NAME_SIZE	=> 16,
+	NULL_LEN	=> 0xffffffff,
+	BUFSIZ		=> 256 * 1024,
+};
+
+#
+# A snapshot is a fixed size header, an index with an entry for each
+# section and then the sections themselves.  Each section is a list of
+# records and each record is a 32 bit length followed by its data.  All
+# integers are big endian.  As the index gives the offset of each of
+# the sections, a reader may mmap(2) the file and go straight to the
+# section that it wants.  See the POD below for the details.
+#
+# The writer writes to a temporary file which is renamed into place by
+# close() so that a snapshot is either complete or not there at all.
+# The sections must all be named when the snapshot is created so that
+# we know how much room to leave for the index which is written last.
+# We write with syswrite() through our own buffer, so that the native
+# code can write a section directly to fileno() after a flush().
+
+sub create {
+	my ($proto, $path, @sections) = @_;
+	my $class = ref($proto) || $proto;
+	my $tmp = "$path.tmp.$$";
+
+	for my $name (@sections) {
+		if (length($name) == 0 || length($name) > NAME_SIZE) {
+			die "Invalid snapshot section name: $name\n";
+		}
+	}
+
+	my $fh = IO::File->new($tmp, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	die "Can't create $tmp: $!\n"	if !defined($fh);
+	binmode($fh);
+
+	my $self = bless({
+		path		=> $path,
+		tmp		=> $tmp,
+		fh		=> $fh,
+		sections	=> [@sections],
+		index		=> {},
+		buf		=> '',
+		cur		=> undef,
+		off		=> HDR_SIZE + IDX_SIZE * @sections,
+	}, $class);
+
+	sysseek($fh, $self->{off}, SEEK_SET) or die "Can't seek $tmp: $!\n";
+
+	return $self;
+}
+
+sub flush {
+	my ($self) = @_;
+	my $len = length($self->{buf});
+	my $done = 0;
+
+	while ($done < $len) {
+		my $n = syswrite($self->{fh}, $self->{buf}, $len - $done,
+		    $done);
+
+		next if !defined($n) && $!{EINTR};
+		die "Can't write $self->{tmp}: $!\n"	if !defined($n);
+		$done += $n;
+	}
+
+	$self->{off} += $len;
+	$self->{buf} = '';
+}
+
+#
+# fileno() flushes our buffer and returns the file descriptor so that
+# a section may be written by other code.  The caller must pass the
+# number of records that it wrote to end().
+
+sub fileno {
+	my ($self) = @_;
+
+	$self->flush();
+	return CORE::fileno($self->{fh});
+}
+
+sub begin {
+	my ($self, $name) = @_;
+
+	if (!grep { $_ eq $name } @{$self->{sections}}) {
+		die "Unknown snapshot section: $name\n";
+	}
+
+	if (exists($self->{index}->{$name}) || defined($self->{cur})) {
+		die "Snapshot section $name is already written\n";
+	}
+
+	$self->flush();
+	$self->{cur} = { name => $name, offset => $self->{off}, count => 0 };
+}
+
+sub record {
+	my ($self, $data) = @_;
+
+	$self->{buf} .= pack('N', length($data)) . $data;
+	$self->{cur}->{count}++;
+
+	$self->flush()		if length($self->{buf}) >= BUFSIZ;
+}
+
+sub row {
+	my ($self, @cols) = @_;
+
+	$self->record(join('', map {
+		defined($_) ? pack('N/a*', $_) : pack('N', NULL_LEN)
+	} @cols));
+}
+
+sub end {
+	my ($self, $count) = @_;
+	my $cur = $self->{cur};
+
+	$self->flush();
+
+	#
+	# If the section was written through fileno(), the file offset
+	# will have moved on without us.
+
+	my $off = sysseek($self->{fh}, 0, SEEK_CUR);
+	die "Can't seek $self->{tmp}: $!\n"	if !defined($off);
+	$self->{off} = $off;
+
+	$count = $cur->{count}	if !defined($count);
+
+	$self->{index}->{$cur->{name}} = [$cur->{offset},
+	    $off - $cur->{offset}, $count];
+	$self->{cur} = undef;
+}
+
+sub close {
+	my ($self) = @_;
+	my $fh = $self->{fh};
+	my @sections = @{$self->{sections}};
+
+	for my $name (@sections) {
+		if (!exists($self->{index}->{$name})) {
+			die "Snapshot section $name was not written\n";
+		}
+	}
+
+	$self->{buf} = pack('a8 N N', MAGIC, VERSION, scalar(@sections)) .
+	    join('', map {
+		pack('a16 Q> Q> Q>', $_, @{$self->{index}->{$_}})
+	    } @sections);
+
+	sysseek($fh, 0, SEEK_SET) or die "Can't seek $self->{tmp}: $!\n";
+	$self->flush();
+
+	$fh->sync()			or die "Can't fsync $self->{tmp}: $!\n";
+	$fh->close()			or die "Can't close $self->{tmp}: $!\n";
+	rename($self->{tmp}, $self->{path}) or
+	    die "Can't rename $self->{tmp} to $self->{path}: $!\n";
+
+	$self->{fh} = undef;
+	return $self->{index};
+}
+
+#
+# open() returns a reader.  The file is read through PerlIO's :mmap
+# layer and only the records that we are asked for are copied out.
+
+sub open {
+	my ($proto, $path) = @_;
+	my $class = ref($proto) || $proto;
+	my ($fh, $hdr);
+
+	CORE::open($fh, '<:mmap', $path) or die "Can't open $path: $!\n";
+
+	if (read($fh, $hdr, HDR_SIZE) != HDR_SIZE) {
+		die "$path is not a krb5_admin snapshot\n";
+	}
+
+	my ($magic, $version, $nsect) = unpack('a8 N N', $hdr);
+
+	if ($magic ne MAGIC) {
+		die "$path is not a krb5_admin snapshot\n";
+	}
+
+	if ($version != VERSION) {
+		die "$path is a version $version snapshot, we only " .
+		    "understand version " . VERSION . "\n";
+	}
+
+	my $idx;
+	if (read($fh, $idx, IDX_SIZE * $nsect) != IDX_SIZE * $nsect) {
+		die "$path: truncated snapshot index\n";
+	}
+
+	my $self = bless({ path => $path, fh => $fh, sections => [],
+	    index => {} }, $class);
+
+	for my $i (0 .. $nsect - 1) {
+		my ($name, @ent) = unpack('Z16 Q> Q> Q>',
+		    substr($idx, $i * IDX_SIZE, IDX_SIZE));
+
+		push(@{$self->{sections}}, $name);
+		$self->{index}->{$name} = [@ent];
+	}
+
+	return $self;
+}
+
+sub sections {
+	my ($self) = @_;
+
+	return @{$self->{sections}};
+}
+
+#
+# section() returns the offset, length and record count of a section.
+
+sub section {
+	my ($self, $name) = @_;
+	my $ent = $self->{index}->{$name};
+
+	die "Snapshot $self->{path} has no section $name\n" if !defined($ent);
+	return @$ent;
+}
+
+sub records {
+	my ($self, $name, $cb) = @_;
+	my $fh = $self->{fh};
+	my ($off, $len, $count) = $self->section($name);
+	my $end = $off + $len;
+
+	seek($fh, $off, SEEK_SET) or die "Can't seek $self->{path}: $!\n";
+
+	while ($off < $end) {
+		my ($hdr, $data);
+
+		if (read($fh, $hdr, 4) != 4) {
+			die "$self->{path}: truncated section $name\n";
+		}
+
+		my $rlen = unpack('N', $hdr);
+		if ($off + 4 + $rlen > $end ||
+		    read($fh, $data, $rlen) != $rlen) {
+			die "$self->{path}: truncated section $name\n";
+		}
+
+		$off += 4 + $rlen;
+		$cb->($data);
+	}
+}
+
+sub decode_row {
+	my ($data) = @_;
+	my @cols;
+	my $off = 0;
+
+	while ($off < length($data)) {
+		my $len = unpack('N', substr($data, $off, 4));
+		$off += 4;
+
+		if ($len == NULL_LEN) {
+			push(@cols, undef);
+			next;
+		}
+
+		push(@cols, substr($data, $off, $len));
+		$off += $len;
+	}
+
+	return @cols;
+}
+
+#
+# rows() calls $cb with an array reference for each row of a table
+# section and returns the names of its columns.
+
+sub rows {
+	my ($self, $name, $cb) = @_;
+	my $cols;
+
+	$self->records($name, sub {
+		my @row = decode_row($_[0]);
+
+		if (!defined($cols)) {
+			$cols = \@row;
+			return;
+		}
+
+		$cb->(\@row);
+	});
+
+	return @{$cols || []};
+}
+
+#
+# columns() returns the names of the columns of a table section without
+# reading its rows.
+
+sub columns {
+	my ($self, $name) = @_;
+	my $fh = $self->{fh};
+	my ($off, $len) = $self->section($name);
+	my ($hdr, $data);
+
+	return () if $len == 0;
+
+	seek($fh, $off, SEEK_SET) or die "Can't seek $self->{path}: $!\n";
+
+	if (read($fh, $hdr, 4) != 4 || 4 + unpack('N', $hdr) > $len ||
+	    read($fh, $data, unpack('N', $hdr)) != unpack('N', $hdr)) {
+		die "$self->{path}: truncated section $name\n";
+	}
+
+	return decode_row($data);
+}
+
+sub DESTROY {
+	my ($self) = @_;
+
+	unlink($self->{tmp})	if defined($self->{tmp}) &&
+				   defined($self->{fh});
+}
+
+1;
+
+__END__
+
+=head1 NAME
+
+Krb5Admin::Snapshot - read and write krb5_admin database snapshots
+
+=head1 SYNOPSIS
+
+	use Krb5Admin::Snapshot;
+
+	my $snap = Krb5Admin::Snapshot->create($path, qw/meta hosts/);
+	$snap->begin('hosts');
+	$snap->row(qw/name realm/);
+	$snap->row('foo.example.com', 'EXAMPLE.COM');
+	$snap->end();
+	...
+	$snap->close();
+
+	my $snap = Krb5Admin::Snapshot->open($path);
+	my @cols = $snap->rows('hosts', sub { my ($row) = @_; ... });
+
+=head1 DESCRIPTION
+
+Krb5Admin::Snapshot implements the file format used by
+B<export_snapshot> and B<import_snapshot> in L<Krb5Admin::KerberosDB>.
+All integers are big endian.  A snapshot starts with a 16 byte header:
+
+	magic		8 bytes, ``KRB5ADMS''
+	version		4 bytes, currently 1
+	sections	4 bytes, the number of sections
+
+which is followed by an index entry of 40 bytes for each section:
+
+	name		16 bytes, NUL padded
+	offset		8 bytes, from the start of the file
+	length		8 bytes
+	count		8 bytes, the number of records
+
+A section is a list of records, each of which is a 4 byte length
+followed by that many bytes of data.  The records of a table section are
+rows, the first of which holds the names of the columns.  A row is a
+list of fields, each of which is a 4 byte length followed by the value
+or the length 0xffffffff for NULL.  The count of a table section
+includes its column names.  The records of the B<principals> section
+are the DER encoded entries of the Kerberos DB with their keys still
+encrypted in the master key.
+
+=head1 METHODS
+
+=over 4
+
+=item create(PATH, SECTION, ...)
+
+creates a new snapshot which will contain the named sections.  It is
+written to a temporary file and only renamed to PATH by B<close>.
+
+=item begin(NAME), record(DATA), row(FIELD, ...), end([COUNT])
+
+write a section.  If the records of the section are written through
+B<fileno> then COUNT must be supplied.
+
+=item fileno()
+
+flushes the buffer and returns the file descriptor so that a section
+may be written directly.
+
+=item close()
+
+writes the index, syncs the file and renames it into place.
+
+=item open(PATH)
+
+opens an existing snapshot for reading through the :mmap layer.
+
+=item sections(), section(NAME)
+
+return the names of the sections and the offset, length and record
+count of a section.
+
+=item records(NAME, CB), rows(NAME, CB)
+
+call CB with each record of a section or with an array reference of
+the fields of each row of a table section.  B<rows> returns the names
+of the columns.
+
+=item columns(NAME)
+
+returns the names of the columns of a table section.
+
+=back
+
+=head1 SEE ALSO
+
+L<Krb5Admin::KerberosDB>
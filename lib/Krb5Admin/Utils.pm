@@ -8,6 +8,17 @@ use Exporter;
 @ISA = qw(Exporter);
 @EXPORT_OK = qw/reverse_the host_list/;
 
+use IO::File;
+use Socket;
+
+use strict;
+use warnings;
+
+use constant {
+	RDNS_POSITIVE_TTL	=> 3600,
+	RDNS_NEGATIVE_TTL	=> 300,
+};
+
 #
 # Host list will, given an IP/Hostname return a list of all of the valid
 # host principals which we would expect that host to contain in their
@@ -19,14 +30,100 @@ sub host_list {
 	return ($hostname);
 }
 
-sub reverse_the {
+#
+# reverse_the() maps an IP address to a hostname.  As the result is used
+# for authorisation, we only return a name if it maps forward to the
+# same address.  Results, including failures, are cached in memory and,
+# if $cachedir is supplied, in a file per address in $cachedir which is
+# shared by all of the processes which use it.  Failures are cached for
+# less time than successes so that a transient DNS problem will not
+# persist.
+
+our %rdns_cache;
+
+sub rdns_lookup {
 	my ($addr) = @_;
 
-#	my $iaddr = inet_aton($addr);
-#	$name  = gethostbyaddr($iaddr, AF_INET);
-#
-#	$name;
-	return undef;	# unimplemented.
+	my $iaddr = inet_aton($addr);
+	return undef if !defined($iaddr);
+
+	my $name = gethostbyaddr($iaddr, AF_INET);
+	return undef if !defined($name);
+
+	my @addrs = (gethostbyname($name))[4..4+64];
+	return undef if !grep { defined($_) && $_ eq $iaddr } @addrs;
+
+	return lc($name);
+}
+
+sub rdns_cache_file {
+	my ($cachedir, $addr) = @_;
+
+	return undef if !defined($cachedir) || $addr !~ /^[0-9.]+$/;
+	return "$cachedir/$addr";
+}
+
+sub rdns_cache_read {
+	my ($cachedir, $addr) = @_;
+	my $file = rdns_cache_file($cachedir, $addr);
+
+	return undef if !defined($file);
+
+	my $fh = IO::File->new($file, 'r');
+	return undef if !defined($fh);
+
+	my @st = stat($fh);
+	return undef if !@st || $st[4] != $>;
+
+	my $line = <$fh>;
+	return undef if !defined($line);
+
+	my ($expires, $name) = split(' ', $line);
+	return undef if !defined($name) || $expires !~ /^\d+$/;
+
+	$name = undef if $name eq '-';
+	return [$name, $expires];
+}
+
+sub rdns_cache_write {
+	my ($cachedir, $addr, $ent) = @_;
+	my $file = rdns_cache_file($cachedir, $addr);
+
+	return if !defined($file);
+
+	my $tmp = "$file.$$";
+	my $fh = IO::File->new($tmp, O_CREAT|O_EXCL|O_WRONLY, 0644);
+	return if !defined($fh);
+
+	my $name = defined($ent->[0]) ? $ent->[0] : '-';
+	print $fh "$ent->[1] $name\n";
+
+	if (!close($fh) || !rename($tmp, $file)) {
+		unlink($tmp);
+	}
+}
+
+sub reverse_the {
+	my ($addr, $cachedir) = @_;
+	my $now = time();
+
+	return undef if !defined($addr);
+
+	my $ent = $rdns_cache{$addr};
+	if (!defined($ent) || $ent->[1] <= $now) {
+		$ent = rdns_cache_read($cachedir, $addr);
+	}
+
+	if (!defined($ent) || $ent->[1] <= $now) {
+		my $name = rdns_lookup($addr);
+
+		$ent = [$name, $now + (defined($name) ? RDNS_POSITIVE_TTL :
+		    RDNS_NEGATIVE_TTL)];
+		rdns_cache_write($cachedir, $addr, $ent);
+	}
+
+	$rdns_cache{$addr} = $ent;
+	return $ent->[0];
 }
 
 
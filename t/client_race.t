@@ -0,0 +1,57 @@
+#!/usr/pkg/bin/perl
+#
+
+use Test::More tests => 6;
+
+use IO::Socket::INET;
+
+use Krb5Admin::Client;
+
+use strict;
+use warnings;
+
+#
+# We stand up a local server on 127.0.0.1 and use 127.0.0.2 on the same
+# port, where nothing listens, as a dead KDC.
+
+my $listener = IO::Socket::INET->new(LocalAddr => '127.0.0.1',
+    Listen => 5, Proto => 'tcp', ReuseAddr => 1)
+    or die "Can't listen: $!";
+my $port  = $listener->sockport();
+my $cache = "t/kdc_failures.$$";
+
+unlink($cache);
+
+my @order;
+
+@order = Krb5Admin::Client::race_servers($port, $cache,
+    qw/127.0.0.2 127.0.0.1/);
+is_deeply(\@order, [qw/127.0.0.1 127.0.0.2/], "live KDC wins the race");
+
+my %failed = Krb5Admin::Client::read_failure_cache($cache);
+is_deeply([keys %failed], ['127.0.0.2'], "dead KDC is remembered");
+
+#
+# With the live KDC first, we should not even try the dead one but it
+# must remain in the failure cache and at the end of the list:
+
+@order = Krb5Admin::Client::race_servers($port, $cache,
+    qw/127.0.0.1 127.0.0.2/);
+is_deeply(\@order, [qw/127.0.0.1 127.0.0.2/], "live KDC stays first");
+
+%failed = Krb5Admin::Client::read_failure_cache($cache);
+ok(exists($failed{'127.0.0.2'}), "dead KDC is still remembered");
+
+#
+# An unchanged cache is not rewritten, and a cache that others can
+# write to is ignored:
+
+my $ino = (stat($cache))[1];
+Krb5Admin::Client::race_servers($port, $cache, qw/127.0.0.1 127.0.0.2/);
+is((stat($cache))[1], $ino, "unchanged failure cache is not rewritten");
+
+chmod(0666, $cache);
+%failed = Krb5Admin::Client::read_failure_cache($cache);
+is_deeply(\%failed, {}, "writable failure cache is ignored");
+
+unlink($cache);
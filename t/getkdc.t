@@ -1,7 +1,9 @@
 #!/usr/pkg/bin/perl
 #
 
-use Test::More tests => 2;
+use Test::More tests => 4;
+
+use IO::File;
 
 use Krb5Admin::C;
 
@@ -48,4 +50,22 @@ is_deeply([sort @$kdcs], $expected, "krb5_get_kdcs() without realm");
 $kdcs  = Krb5Admin::C::krb5_get_kdcs($ctx, $realm);
 is_deeply([sort @$kdcs], $expected, "krb5_get_kdcs() with realm");
 
+#
+# With a cache file configured, a fresh lookup is written to it:
+
+my $cache = "t/kdc_cache.$$";
+
+unlink($cache);
+Krb5Admin::C::krb5_kdc_cache_config($cache, 0);
+Krb5Admin::C::krb5_kdc_cache_config($cache, 300);
+
+$kdcs  = Krb5Admin::C::krb5_get_kdcs($ctx, $realm);
+is_deeply([sort @$kdcs], $expected, "krb5_get_kdcs() with a cache file");
+
+my $fh = IO::File->new($cache, 'r');
+my $line = defined($fh) ? <$fh> : '';
+like($line, qr/^\Q$realm\E \d+ .*kdc1\.test\.realm/, "KDCs are cached on disk");
+
+unlink($cache);
+
 exit 0;
@@ -0,0 +1,50 @@
+#!/usr/pkg/bin/perl
+#
+
+use Test::More tests => 7;
+
+use Krb5Admin::C;
+
+use strict;
+use warnings;
+
+$ENV{KRB5_CONFIG} = './t/krb5.conf';
+
+my $dbname = 'db:t/test-hdb';
+my $hndl;
+my $stats;
+
+my $base = Krb5Admin::C::kadm5_pool_get_stats();
+
+$hndl  = Krb5Admin::C::kadm5_pool_get($dbname);
+$stats = Krb5Admin::C::kadm5_pool_get_stats();
+is($stats->{misses} - $base->{misses}, 1, "first handle is initialised");
+is($stats->{in_use}, $base->{in_use} + 1, "and is lent out");
+
+undef $hndl;
+$stats = Krb5Admin::C::kadm5_pool_get_stats();
+is($stats->{idle}, $base->{idle} + 1, "released handle goes back to the pool");
+
+$hndl  = Krb5Admin::C::kadm5_pool_get($dbname);
+$stats = Krb5Admin::C::kadm5_pool_get_stats();
+is($stats->{hits} - $base->{hits}, 1, "second handle comes from the pool");
+
+#
+# The handle must still work, we list the principals as a check:
+
+my $princs = Krb5Admin::C::krb5_list_princs(
+    Krb5Admin::C::krb5_init_context(), $hndl, '*');
+ok(ref($princs) eq 'ARRAY', "pooled handle is usable");
+
+#
+# An invalidated handle is destroyed rather than lent out again:
+
+Krb5Admin::C::kadm5_pool_invalidate($hndl);
+undef $hndl;
+$stats = Krb5Admin::C::kadm5_pool_get_stats();
+is($stats->{destroyed} - $base->{destroyed}, 1,
+    "invalidated handle is destroyed on release");
+
+$hndl  = Krb5Admin::C::kadm5_pool_get($dbname);
+$stats = Krb5Admin::C::kadm5_pool_get_stats();
+is($stats->{misses} - $base->{misses}, 2, "and a new one is initialised");
@@ -1,6 +1,6 @@
 #!/usr/pkg/bin/perl
 
-use Test::More tests => 36;
+use Test::More tests => 89;
 
 use Krb5Admin::KerberosDB;
 
@@ -46,6 +46,8 @@ my $proid1 = 'proid1@TEST.REALM';
 my $proid2 = 'proid2@TEST.REALM';
 my $proid3 = 'proid3@TEST.REALM';
 my $proid4 = 'proid4@TEST.REALM';
+my $proid5 = 'proid5@TEST.REALM';
+my $proid6 = 'proid6@TEST.REALM';
 
 #
 # First, we create three hosts.
@@ -199,6 +201,284 @@ testObjC("Query logical.test.realm's tickets", $kmdb,
 		      ['logical.test.realm','baz.test.realm']]}],
 	"query_ticket", host => 'logical.test.realm', verbose => 1);
 
+#
+# And by realm, which is what fetch_tickets() does:
+
+testObjC("Query bar.test.realm's TEST.REALM tickets", $kmdb,
+	[{$proid2 => [['bar.test.realm']],
+	  $proid4 => [['logical.test.realm','bar.test.realm']]}],
+	"query_ticket", host => 'bar.test.realm', realm => 'TEST.REALM',
+	verbose => 1);
+
+testObjC("Query bar.test.realm's OTHER.REALM tickets", $kmdb, [{}],
+	"query_ticket", host => 'bar.test.realm', realm => 'OTHER.REALM',
+	verbose => 1);
+
+#
+# Changes to the hostmap must be reflected in the expanded tickets:
+
+testObjC("Remove a mapping", $kmdb, [undef], 'remove_hostmap',
+	qw/logical.test.realm baz.test.realm/);
+
+testObjC("Query baz.test.realm's tickets (expand)", $kmdb, [[$proid3]],
+	"query_ticket", host => 'baz.test.realm', expand => 1);
+
+testObjC("Recreate a mapping", $kmdb, [undef], 'insert_hostmap',
+	qw/logical.test.realm baz.test.realm/);
+
+my $tix = eval {
+	$kmdb->query_ticket(host => 'baz.test.realm', expand => 1)
+} || [];
+is_deeply([sort @$tix], [$proid3, $proid4],
+	"Query baz.test.realm's tickets (expand)") or diag(Dumper($@, $tix));
+
+#
+# Multiple hosts in a single insert_ticket/remove_ticket are done in
+# bulk and so we check that they behave the same as individual calls.
+
+testObjC("Insert a ticket on many hosts", $kmdb, [undef], 'insert_ticket',
+	$proid1, qw/bar.test.realm baz.test.realm logical.test.realm/);
+
+$tix = eval { $kmdb->query_ticket(principal => $proid1) } || [];
+is_deeply([sort @$tix],
+	[qw/bar.test.realm baz.test.realm foo.test.realm logical.test.realm/],
+	"Query ${proid1}'s tickets") or diag(Dumper($@, $tix));
+
+testObjC("Remove a ticket from many hosts", $kmdb, [undef], 'remove_ticket',
+	$proid1, qw/bar.test.realm baz.test.realm logical.test.realm/);
+
+testObjC("Query ${proid1}'s tickets", $kmdb, [['foo.test.realm']],
+	"query_ticket", principal => $proid1);
+
+#
+# The hosts are validated as a set, but an unknown host anywhere in
+# the list must still fail the entire request:
+
+eval {
+	$kmdb->insert_ticket($proid1, qw/bar.test.realm nosuch.test.realm/);
+};
+ok(ref($@) eq 'ARRAY' && $@->[0] == 504 && $@->[1] =~ /nosuch/,
+	"Insert a ticket on an unknown host") or diag(Dumper($@));
+
+testObjC("Query ${proid1}'s tickets", $kmdb, [['foo.test.realm']],
+	"query_ticket", principal => $proid1);
+
+#
+# We fill baz.test.realm up to MAX_TIX_PER_HOST and check that one more
+# ticket is refused and that nothing of the refused insert is left:
+
+{
+	my $dbh = $kmdb->{dbh};
+	my ($n) = $dbh->selectrow_array("SELECT COUNT(*) FROM prestashed " .
+	    "WHERE host = 'baz.test.realm'");
+	my $fill = Krb5Admin::KerberosDB::MAX_TIX_PER_HOST - $n;
+
+	$dbh->do("INSERT INTO prestashed (principal, host, realm) " .
+	    "VALUES (?, 'baz.test.realm', 'TEST.REALM')", {},
+	    "fill$_\@TEST.REALM") for (1 .. $fill);
+	$dbh->commit();
+
+	eval { $kmdb->insert_ticket($proid1, 'baz.test.realm') };
+	is(ref($@) ? $@->[0] : $@, 500, "Limit the tickets on a host");
+	testObjC("Query ${proid1}'s tickets", $kmdb, [['foo.test.realm']],
+		"query_ticket", principal => $proid1);
+
+	$dbh->do("DELETE FROM prestashed WHERE principal LIKE 'fill%'");
+	$dbh->commit();
+}
+
+#
+# Logical hosts may be mapped onto other logical hosts, in which case
+# the tickets are expanded through every level of the hostmap:
+
+testObjC("Create a host", $kmdb, [undef], 'create_host', 'service.test.realm',
+	ip_addr => '4.4.4.4', realm => 'TEST.REALM');
+testObjC("Create a nested mapping", $kmdb, [undef], 'insert_hostmap',
+	qw/service.test.realm logical.test.realm/);
+testObjC("Insert a ticket", $kmdb, [undef], 'insert_ticket', $proid5,
+	'service.test.realm');
+
+testObjC("Query bar.test.realm's tickets", $kmdb,
+	[{$proid2 => [['bar.test.realm']],
+	  $proid4 => [['logical.test.realm','bar.test.realm']],
+	  $proid5 => [['service.test.realm','bar.test.realm']]}],
+	"query_ticket", host => 'bar.test.realm', verbose => 1);
+
+eval {
+	$kmdb->insert_hostmap(qw/bar.test.realm service.test.realm/);
+};
+ok($@, "Refuse to create a loop in the hostmap");
+
+testObjC("Remove a nested mapping", $kmdb, [undef], 'remove_hostmap',
+	qw/service.test.realm logical.test.realm/);
+
+$tix = eval {
+	$kmdb->query_ticket(host => 'bar.test.realm', expand => 1)
+} || [];
+is_deeply([sort @$tix], [$proid2, $proid4],
+	"Query bar.test.realm's tickets (expand)") or diag(Dumper($@, $tix));
+
+#
+# Read-only calls can be batched and each returns its own result or error:
+
+my @batch = eval {
+	$kmdb->batch([query_ticket => principal => $proid1],
+	    [query_hostmap => 'logical.test.realm'],
+	    [insert_ticket => $proid1, 'bar.test.realm']);
+};
+is_deeply([map { $_->{result} } @batch[0,1]],
+	[[['foo.test.realm']], [[qw/bar.test.realm baz.test.realm/]]],
+	"Batch of read-only calls") or diag(Dumper($@, \@batch));
+ok(exists($batch[2]->{error}), "Batches refuse writes");
+
+#
+# Shared principals get a single ticket per logical host per interval:
+
+testObjC("Share a ticket", $kmdb, [undef], 'share_ticket', $proid4, 1);
+testObjC("Shared tickets on bar.test.realm", $kmdb,
+	[{ $proid4 => 'logical.test.realm' }], 'shared_tickets',
+	'bar.test.realm', 'TEST.REALM');
+
+{
+	no warnings 'redefine';
+	local *Krb5Admin::C::mint_ticket = sub {
+		return { client => $_[2], server => 'krbtgt/TEST.REALM',
+		    ticket => 'ticket', keyblock => { key => 'key' } };
+	};
+
+	my $before = $kmdb->ticket_cache_stats();
+	my $bar = $kmdb->mint_prestashed($proid4, 'logical.test.realm');
+	my $baz = $kmdb->mint_prestashed($proid4, 'logical.test.realm');
+	my $after = $kmdb->ticket_cache_stats();
+
+	is($bar, $baz, "Members of a logical host share a ticket");
+	is($after->{hits} - $before->{hits}, 1, "Shared ticket cache hit");
+}
+
+#
+# Hosts may be labelled in bulk and then selected by label:
+
+testObjC("Label hosts", $kmdb, [undef], 'insert_host_label', 'web',
+	qw/foo.test.realm bar.test.realm/);
+testObjC("Label hosts", $kmdb, [undef], 'modify_host', 'bar.test.realm',
+	add_label => [qw/db prod/]);
+testObjC("Query hosts with all labels", $kmdb,
+	[{ 'bar.test.realm' => { realm => 'TEST.REALM', ip_addr => '2.2.2.2',
+	   bootbinding => undef, label => [qw/db prod web/] } }],
+	'query_host', label => [qw/web db/]);
+my $hosts = eval {
+	$kmdb->query_host(label => [qw/web db/], match => 'any')
+} || {};
+is_deeply([sort keys %$hosts], [qw/bar.test.realm foo.test.realm/],
+	"Query hosts with any label") or diag(Dumper($@, $hosts));
+testObjC("Unlabel hosts", $kmdb, [undef], 'remove_host_label', 'web',
+	qw/bar.test.realm baz.test.realm/);
+$hosts = eval { $kmdb->query_host(label => 'web') } || {};
+is_deeply([sort keys %$hosts], [qw/foo.test.realm/],
+	"Query hosts after unlabelling") or diag(Dumper($@, $hosts));
+
+eval { $kmdb->insert_host_label('web', 'nonexistent.test.realm') };
+ok($@, "Refuse to label a nonexistent host");
+
+#
+# Tickets may be prestashed on a label, which is resolved when they
+# are fetched:
+
+testObjC("Insert a ticket on a label", $kmdb, [undef], 'insert_ticket',
+	$proid6, 'label:web');
+testObjC("Query the label's tickets", $kmdb, [[$proid6]], 'query_ticket',
+	host => 'label:web');
+testObjC("Query ${proid6}'s tickets", $kmdb, [['label:web']],
+	'query_ticket', principal => $proid6);
+
+$tix = eval {
+	$kmdb->query_ticket(host => 'foo.test.realm', expand => 1)
+} || [];
+is_deeply([sort @$tix], [$proid1, $proid6],
+	"Query a labelled host's tickets (expand)") or diag(Dumper($@, $tix));
+
+eval { $kmdb->insert_ticket($proid6, 'label:nosuchlabel') };
+is(ref($@) ? $@->[0] : $@, 504, "Refuse to prestash on an unknown label");
+
+#
+# The tickets on a label count against the limit of each of its hosts.
+# foo.test.realm has $proid1 and $proid6 and so we fill it up to the
+# limit through label:web:
+
+{
+	my $dbh = $kmdb->{dbh};
+	my $fill = Krb5Admin::KerberosDB::MAX_TIX_PER_HOST - 2;
+
+	$dbh->do("INSERT INTO prestash_labels (principal, target, realm) " .
+	    "VALUES (?, 'label:web', 'TEST.REALM')", {}, "fill$_\@TEST.REALM")
+	    for (1 .. $fill);
+	$dbh->commit();
+
+	my $before = eval { $kmdb->query_ticket(principal => $proid2) };
+
+	eval { $kmdb->insert_ticket($proid2, 'foo.test.realm') };
+	is(ref($@) ? $@->[0] : $@, 500, "Label tickets count against a host");
+	eval { $kmdb->insert_ticket($proid2, 'label:web') };
+	is(ref($@) ? $@->[0] : $@, 500, "A label's hosts limit its tickets");
+	testObjC("Refused tickets are not inserted", $kmdb, [$before],
+		'query_ticket', principal => $proid2);
+
+	$dbh->do("DELETE FROM prestash_labels WHERE principal LIKE 'fill%'");
+	$dbh->commit();
+
+	testObjC("Insert a ticket on a label under the limit", $kmdb,
+		[undef], 'insert_ticket', $proid2, 'label:web');
+	testObjC("Remove a ticket from a label", $kmdb, [undef],
+		'remove_ticket', $proid2, 'label:web');
+}
+
+testObjC("Remove a ticket from a label", $kmdb, [undef], 'remove_ticket',
+	$proid6, 'label:web');
+testObjC("Query a labelled host's tickets (expand)", $kmdb, [[$proid1]],
+	'query_ticket', host => 'foo.test.realm', expand => 1);
+
+#
+# Hosts may be created and removed in bulk with an error per host:
+
+testObjC("Create hosts", $kmdb,
+	[[undef, [500, 'Host foo.test.realm already exists.'], undef]],
+	'create_hosts', [
+	    { name => 'bulk1.test.realm', realm => 'TEST.REALM',
+	      label => ['bulk'] },
+	    { name => 'foo.test.realm', realm => 'TEST.REALM' },
+	    { name => 'bulk2.test.realm', realm => 'TEST.REALM',
+	      ip_addr => '4.4.4.4', label => ['bulk'] },
+	]);
+
+$hosts = eval { $kmdb->query_host(label => 'bulk') } || {};
+is_deeply([sort keys %$hosts], [qw/bulk1.test.realm bulk2.test.realm/],
+	"Query the created hosts") or diag(Dumper($@, $hosts));
+
+testObjC("Remove hosts", $kmdb,
+	[[undef, [500, 'Host bar.test.realm is still in use by the hostmap ' .
+	    'or has prestashed tickets.'], undef,
+	  [500, 'Host nonexistent.test.realm does not exist.']]],
+	'remove_host', qw/bulk1.test.realm bar.test.realm bulk2.test.realm
+	nonexistent.test.realm/);
+
+$hosts = eval { $kmdb->query_host(label => 'bulk') } || {};
+is_deeply($hosts, {}, "Removed hosts lose their labels")
+	or diag(Dumper($@, $hosts));
+
+#
+# krb5_admind -P rebinds a single object to each new connexion rather
+# than constructing a new one:
+
+$kmdb->{curve25519KerberosDBsecret} = 'a previous client\'s secret';
+
+my $rebound = $kmdb->rebind(client => 'host/bar.test.realm@TEST.REALM',
+	addr => '2.2.2.2');
+is($rebound->{dbh}, $kmdb->{dbh}, "Rebind to a new connexion");
+
+ok(!exists($rebound->{curve25519KerberosDBsecret}),
+	"Rebind does not carry the ECDH secret over");
 
+testObjC("Query ${proid1}'s tickets after rebind", $rebound,
+	[['foo.test.realm']], "query_ticket", principal => $proid1);
 
 exit(0);
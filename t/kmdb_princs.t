@@ -1,6 +1,6 @@
 #!/usr/pkg/bin/perl
 
-use Test::More tests => 44;
+use Test::More tests => 49;
 
 use Krb5Admin::C;
 use Krb5Admin::KerberosDB;
@@ -167,6 +167,75 @@ $result = $kmdb->query('user');
 compare_princ_to_attrs($result, [qw/+requires_preauth -allow_svr/],
     "user has correct attributes 2");
 
+#
+# query() caches the metadata, so a second query should be a hit and
+# should not be affected by changes that the caller makes to the first.
+
+{
+	my $before = $kmdb->query_cache_stats();
+
+	$result = $kmdb->query('user');
+	push(@{$result->{attributes}}, '+bogus');
+	delete $result->{keys};
+
+	$result = $kmdb->query('user');
+	my $after = $kmdb->query_cache_stats();
+
+	ok($after->{hits} > $before->{hits}, "repeated query hits the cache");
+	compare_princ_to_attrs($result, [qw/+requires_preauth -allow_svr/],
+	    "cached query is not modified by its caller");
+	ok(!grep({ exists($_->{key}) } @{$result->{keys}}),
+	    "cached query does not contain keys");
+}
+
+#
+# A write made by another process bumps the KDB's generation in the SQL
+# DB which must flush our cache:
+
+{
+	$kmdb->query('user');
+	my $before = $kmdb->query_cache_stats();
+
+	$kmdb->kdb_changed();
+	$kmdb->query('user');
+	my $after = $kmdb->query_cache_stats();
+
+	ok($after->{flushes} > $before->{flushes} &&
+	    $after->{misses} > $before->{misses},
+	    "a new KDB generation flushes the query cache");
+}
+
+#
+# As does a write made through kadm5 by kadmin or kpasswdd which we see
+# as a new entry at the end of the kadm5 log.  We stand in for Heimdal
+# here with a log of our own whose entries are just their versions:
+
+{
+	my $log = 't/test-kadm5.log';
+	my $fh;
+
+	no warnings 'redefine';
+	local *Krb5Admin::C::kadm5_log_file = sub { $log };
+
+	open($fh, '>', $log) && print $fh pack('N', 1);
+	close($fh);
+
+	$kmdb->query('user');
+	my $before = $kmdb->query_cache_stats();
+
+	open($fh, '>>', $log) && print $fh pack('N', 2);
+	close($fh);
+
+	$kmdb->query('user');
+	my $after = $kmdb->query_cache_stats();
+
+	ok($after->{flushes} > $before->{flushes} &&
+	    $after->{misses} > $before->{misses},
+	    "a new kadm5 log entry flushes the query cache");
+
+	unlink($log);
+}
+
 #
 # Test mquery and remove.
 
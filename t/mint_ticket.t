@@ -1,7 +1,7 @@
 #!/usr/pkg/bin/perl
 #
 
-use Test::More tests => 2;
+use Test::More tests => 5;
 
 use Krb5Admin::C;
 
@@ -62,4 +62,32 @@ eval {
 
 ok(!$@) or diag("$@");
 
+#
+# krb5_prestash sends the client and TGT endtime of its ccaches to
+# fetch_tickets() so that it is only sent the tickets that it needs.
+
+my @state = eval { Krb5Admin::C::read_ccache_tgt($ctx, "FILE:$ccfile") };
+is_deeply(\@state, [$ret->{client}, $ret->{endtime}],
+    "read_ccache_tgt returns the client and the TGT's endtime")
+    or diag("$@");
+
+#
+# store_ccache() only writes a ccache if its contents would change:
+
+my $stored = "./t/krb5cc_stored.$$";
+END { unlink($stored); }
+
+my ($gid) = split(' ', $();
+my @written = eval {
+	map {
+		Krb5Admin::C::store_ccache($ctx, $stored, $ret, $<, $gid)
+	} (1, 2);
+};
+is_deeply(\@written, [1, 0], "store_ccache skips unchanged ccaches")
+    or diag("$@");
+
+@state = eval { Krb5Admin::C::read_ccache_tgt($ctx, "FILE:$stored") };
+is_deeply(\@state, [$ret->{client}, $ret->{endtime}],
+    "store_ccache wrote the credentials") or diag("$@");
+
 exit 0;
@@ -26,7 +26,7 @@ my @tests = (
 	    [ 'TEST.REALM', 'HTTP', 'host2.test.realm' ]],
 );
 
-plan tests => scalar(@tests);
+plan tests => 4 * scalar(@tests) + 3;
 
 for my $test (@tests) {
 	my $princ  = $test->[0];
@@ -35,6 +35,30 @@ for my $test (@tests) {
 	my $ret = [Krb5Admin::C::krb5_parse_name($ctx, $princ)];
 
 	is_deeply($ret, $result, $princ);
+
+	#
+	# The cached parser must agree with krb5_parse_name(), including
+	# the second time when the result comes from the cache:
+
+	for my $i (1..2) {
+		$ret = [Krb5Admin::C::parse_name($ctx, $princ)];
+		is_deeply($ret, $result, "parse_name($princ) #$i");
+	}
+
+	is_deeply([Krb5Admin::C::parse_name_canon($ctx, $princ)],
+	    [$princ, @$result], "parse_name_canon($princ)");
 }
 
+#
+# Principals with quoted characters:
+
+my $quoted = 'a\\/b@TEST.REALM';
+
+is_deeply([Krb5Admin::C::parse_name_canon($ctx, $quoted)],
+    [$quoted, 'TEST.REALM', 'a/b'], "parse_name_canon($quoted)");
+is(Krb5Admin::C::unparse_name($ctx, ['TEST.REALM', 'a/b']), $quoted,
+    "unparse_name() quotes components");
+is(Krb5Admin::C::unparse_name($ctx, ['TEST.REALM', 'host', 'foo']),
+    'host/foo@TEST.REALM', "unparse_name()");
+
 exit(0);
@@ -0,0 +1,47 @@
+#!/usr/pkg/bin/perl
+#
+
+use Test::More tests => 8;
+
+use IO::File;
+
+use Krb5Admin::Policy;
+
+use strict;
+use warnings;
+
+my $acl_file = "t/policy_acl.$$";
+IO::File->new($acl_file, 'w') or die "Can't create $acl_file: $!";
+
+my %args = (
+	acl_file		=> $acl_file,
+	xrealm_bootstrap	=> { 'A.REALM' => ['B.REALM'] },
+	win_xrealm_bootstrap	=> {
+		'host/win1.a.realm@A.REALM' => ['host/win1.b.realm@B.REALM'],
+	},
+	prestash_xrealm		=> { 'A.REALM' => ['A.REALM', 'B.REALM'] },
+);
+
+my $policy = Krb5Admin::Policy->get(%args);
+
+ok($policy->xrealm_bootstrap('A.REALM', 'B.REALM'), "xrealm allowed");
+ok(!$policy->xrealm_bootstrap('B.REALM', 'A.REALM'), "xrealm denied");
+ok($policy->win_xrealm_bootstrap('host/win1.a.realm@A.REALM',
+    'host/win1.b.realm@B.REALM'), "win xrealm allowed");
+is_deeply($policy->prestash_realms('A.REALM'),
+    {'A.REALM' => 1, 'B.REALM' => 1}, "prestash xrealm configured");
+is_deeply($policy->prestash_realms('C.REALM'), {'C.REALM' => 1},
+    "prestash xrealm default");
+
+#
+# The policy is shared until either the tables or the file changes:
+
+is(Krb5Admin::Policy->get(%args), $policy, "policy is shared");
+
+isnt(Krb5Admin::Policy->get(%args, prestash_xrealm => {}), $policy,
+    "different tables, different policy");
+
+utime(time() + 10, time() + 10, $acl_file);
+isnt(Krb5Admin::Policy->get(%args), $policy, "ACL file change rebuilds");
+
+unlink($acl_file);
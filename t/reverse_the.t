@@ -0,0 +1,46 @@
+#!/usr/pkg/bin/perl
+#
+
+use Test::More tests => 6;
+
+use Krb5Admin::Utils qw/reverse_the/;
+
+use strict;
+use warnings;
+
+#
+# We replace the resolver so that the test does not depend on DNS and so
+# that we can count the lookups.
+
+my %names = ('192.0.2.1' => 'host1.test.realm');
+my $lookups = 0;
+
+{
+	no warnings 'redefine';
+	*Krb5Admin::Utils::rdns_lookup = sub {
+		$lookups++;
+		return $names{$_[0]};
+	};
+}
+
+my $cachedir = "t/rdns.$$";
+mkdir($cachedir, 0700) or die "mkdir: $!";
+
+is(reverse_the('192.0.2.1', $cachedir), 'host1.test.realm', "lookup");
+is(reverse_the('192.0.2.1', $cachedir), 'host1.test.realm', "cached lookup");
+is($lookups, 1, "second lookup came from the cache");
+
+is(reverse_the('192.0.2.2', $cachedir), undef, "failed lookup");
+reverse_the('192.0.2.2', $cachedir);
+is($lookups, 2, "failures are cached");
+
+#
+# Another process would only see the cache directory:
+
+%Krb5Admin::Utils::rdns_cache = ();
+reverse_the('192.0.2.1', $cachedir);
+reverse_the('192.0.2.2', $cachedir);
+is($lookups, 2, "cache is shared through the cache directory");
+
+unlink(glob("$cachedir/*"));
+rmdir($cachedir);
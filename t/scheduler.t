@@ -0,0 +1,63 @@
+#!/usr/pkg/bin/perl
+#
+
+use Test::More tests => 8;
+
+use Krb5Admin::Scheduler;
+
+use strict;
+use warnings;
+
+my $dir = "t/sched.$$";
+
+my $sched = Krb5Admin::Scheduler->new(dir => $dir, slots => 1, timeout => 1);
+
+is(Krb5Admin::Scheduler::classify('query', 'user'), 'cheap', "query is cheap");
+is(Krb5Admin::Scheduler::classify('mquery'), 'expensive',
+    "mquery of everything is expensive");
+is(Krb5Admin::Scheduler::classify('fetch_tickets'), 'expensive',
+    "fetch_tickets is expensive");
+
+#
+# A child takes the only slot and holds it while we try to get it.
+
+pipe(my $r, my $w) or die "pipe: $!";
+
+my $pid = fork();
+die "fork: $!" if !defined($pid);
+
+if ($pid == 0) {
+	close($r);
+	my $token = $sched->admit('fetch_tickets');
+	close($w);
+	sleep(3);
+	exit(0);
+}
+
+close($w);
+<$r>;
+close($r);
+
+my $token = eval { $sched->admit('query', 'user') };
+ok(!$@ && defined($token), "cheap calls are not queued");
+
+eval { $sched->admit('fetch_tickets') };
+is(ref($@) eq 'ARRAY' ? $@->[0] : $@, 500, "expensive call times out");
+
+waitpid($pid, 0);
+
+$token = eval { $sched->admit('fetch_tickets') };
+ok(!$@ && defined($token), "expensive call admitted once the slot is free");
+
+my $inner = eval { $sched->admit('mquery') };
+ok(!$@, "nested expensive calls do not deadlock");
+
+undef $inner;
+undef $token;
+
+my $stats = $sched->stats();
+is_deeply([@$stats{qw/admitted rejected queue_depth/}], [1, 1, 0],
+    "stats count the calls");
+
+unlink(glob("$dir/*"));
+rmdir($dir);
@@ -0,0 +1,138 @@
+#!/usr/pkg/bin/perl
+
+use Test::More tests => 12;
+
+use Krb5Admin::KerberosDB;
+use Krb5Admin::Snapshot;
+
+use Data::Dumper;
+
+use strict;
+use warnings;
+
+$ENV{KRB5_CONFIG} = './t/krb5.conf';
+
+my $snapfile = 't/snapshot.snap';
+
+my $kmdb = Krb5Admin::KerberosDB->new(
+    local	=> 1,
+    dbname	=> 'db:t/test-hdb',
+    sqlite	=> 't/sqlite-snapshot.db',
+);
+
+#
+# XXXrcd: This is destructive!
+
+$kmdb->drop_db();
+$kmdb->init_db();
+
+$kmdb->create_hosts([
+	{ name => 'foo.test.realm', realm => 'TEST.REALM',
+	  ip_addr => '1.1.1.1', label => [qw/web prod/] },
+	{ name => 'bar.test.realm', realm => 'TEST.REALM' },
+	{ name => 'logical.test.realm', realm => 'TEST.REALM' },
+]);
+$kmdb->insert_hostmap(qw/logical.test.realm bar.test.realm/);
+$kmdb->insert_ticket('proid1@TEST.REALM', 'foo.test.realm',
+	'logical.test.realm');
+$kmdb->insert_ticket('proid2@TEST.REALM', 'label:web');
+
+unlink($snapfile);
+
+my $counts = eval { $kmdb->export_snapshot($snapfile) };
+ok(defined($counts), "Export a snapshot") or diag(Dumper($@));
+
+my @princs = $kmdb->list('*');
+is($counts->{principals}, scalar(@princs), "Exported all of the principals");
+
+my $snap = eval { Krb5Admin::Snapshot->open($snapfile) };
+is_deeply([eval { $snap->sections() }],
+	[qw/meta principals hosts host_labels hostmap prestashed
+	    prestash_labels prestash_shared/],
+	"Snapshot sections") or diag(Dumper($@));
+
+my @rows;
+my @cols = eval {
+	$snap->rows('hosts', sub { push(@rows, $_[0]) });
+};
+is_deeply([\@cols, [sort { $a->[0] cmp $b->[0] } @rows]],
+	[[qw/name realm ip_addr bootbinding/],
+	 [['bar.test.realm', 'TEST.REALM', undef, undef],
+	  ['foo.test.realm', 'TEST.REALM', '1.1.1.1', undef],
+	  ['logical.test.realm', 'TEST.REALM', undef, undef]]],
+	"Snapshot hosts") or diag(Dumper($@, \@cols, \@rows));
+
+@rows = ();
+eval { $snap->rows('prestash_labels', sub { push(@rows, $_[0]) }) };
+is_deeply(\@rows, [['proid2@TEST.REALM', 'label:web', 'TEST.REALM']],
+	"Snapshot label targets") or diag(Dumper($@, \@rows));
+
+my $n = 0;
+eval { $snap->records('principals', sub { $n++ }) };
+is($n, $counts->{principals}, "Read back the principals")
+	or diag(Dumper($@));
+
+#
+# Load the snapshot into a second SQL DB.  The principals are stored
+# back into the same KDB which is harmless.
+
+my $kmdb2 = Krb5Admin::KerberosDB->new(
+    local	=> 1,
+    dbname	=> 'db:t/test-hdb',
+    sqlite	=> 't/sqlite-snapshot2.db',
+);
+
+$kmdb2->drop_db();
+$kmdb2->init_db();
+$kmdb2->create_host('stale.test.realm', realm => 'TEST.REALM');
+
+my @hosts = qw/foo.test.realm bar.test.realm logical.test.realm
+	stale.test.realm/;
+
+my $icounts = eval { $kmdb2->import_snapshot($snapfile) };
+is_deeply($icounts, $counts, "Import the snapshot") or diag(Dumper($@));
+
+is_deeply([map { scalar($kmdb2->query_host(name => $_)) } @hosts],
+	[map { scalar($kmdb->query_host(name => $_)) } @hosts],
+	"Imported hosts and removed the stale one");
+
+is_deeply([sort(keys %{$kmdb2->query_host(label => 'web')})],
+	['foo.test.realm'], "Imported labels");
+
+is_deeply([sort @{$kmdb2->query_ticket(host => 'bar.test.realm',
+	expand => 1)}], ['proid1@TEST.REALM'],
+	"Imported hostmap and prestashed tickets");
+
+#
+# A snapshot whose principals do not match its index is refused before
+# either the KDB or the SQL DB is touched.  We bump the record count of
+# the principals, the second entry in the index after the header.
+
+{
+	my $bad = 't/snapshot-bad.snap';
+	my ($in, $out, $data);
+
+	open($in, '<', $snapfile) && read($in, $data, -s $snapfile);
+	close($in);
+	my $pos = 16 + 40 + 16 + 8 + 8;
+	substr($data, $pos, 8, pack('Q>', unpack('Q>',
+	    substr($data, $pos, 8)) + 1));
+	open($out, '>', $bad) && print $out $data;
+	close($out);
+
+	$kmdb2->create_host('stale.test.realm', realm => 'TEST.REALM');
+
+	eval { $kmdb2->import_snapshot($bad) };
+	is(ref($@) ? $@->[0] : $@, 503, "Refuse a snapshot missing principals");
+	my $host = eval { $kmdb2->query_host(name => 'stale.test.realm') };
+	is(ref($host) eq 'HASH' ? $host->{realm} : undef, 'TEST.REALM',
+		"A refused snapshot leaves the SQL DB alone");
+
+	unlink($bad);
+}
+
+$kmdb2->drop_db();
+
+unlink($snapfile);
+
+exit(0);